@@ -71,6 +71,8 @@ int main()
 			bench<impl::UncompressedWaveDatabase<false>>(vals, jumpy);
 			std::println("elias fano");
 			bench<impl::EliasFanoWaveDatabase>(vals, jumpy);
+			std::println("partitioned elias fano");
+			bench<impl::PartitionedEliasFanoWaveDatabase>(vals, jumpy);
 			std::println("auto tune");
 			bench<WaveDatabase>(vals, jumpy);
 		}
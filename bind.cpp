@@ -6,7 +6,9 @@
 #include "histogram.h"
 #include "fst_file.h"
 #include "waveform_viewer.h"
+#include "trace.h"
 
+#include <array>
 #include <print>
 #include <pybind11/embed.h>
 #include <pybind11/functional.h>
@@ -30,6 +32,18 @@ inline py::array_t<typename Sequence::value_type> as_pyarray(Sequence&& seq)
 	return py::array(size, data, capsule);
 }
 
+// read only view of data in a shared buffer, which stays alive as long as the array does
+template <typename T, typename Owner>
+inline py::array_t<T> as_pyarray(std::shared_ptr<const Owner> owner, std::span<const T> data)
+{
+	auto owner_ptr = new std::shared_ptr<const Owner>(std::move(owner));
+	auto capsule = py::capsule(
+	    owner_ptr, [](void* p) { delete reinterpret_cast<std::shared_ptr<const Owner>*>(p); });
+	py::array array(data.size(), data.data(), capsule);
+	array.attr("setflags")("write"_a = false);
+	return array;
+}
+
 
 struct AsyncNode: public std::enable_shared_from_this<AsyncNode>
 {
@@ -63,14 +77,16 @@ PYBIND11_MAKE_OPAQUE(decltype(NodeVar::attrs))
 
 MYPYBIND11_MODULE(mesh_viz, m)
 {
-	m.def("load", [](std::string filename) {
+	// a file or a directory of them
+	m.def("load", [](std::string path) {
 		AsyncRunner async_runner;
-		auto f = std::make_shared<FstFile>(filename.c_str());
+		auto trace = std::make_shared<Trace>(std::span(&path, 1));
 		Highlights highlights;
-		WaveformViewer waveform_viewer(f, &highlights);
-		Histograms histograms(f, &highlights);
-		return f->read_nodes(&waveform_viewer, &histograms, &async_runner);
+		WaveformViewer waveform_viewer(trace, &highlights);
+		Histograms histograms(&highlights);
+		return trace->read_nodes(&waveform_viewer, &histograms, &async_runner);
 	});
+	m.def("buffer_pool_stats", [] { return std::format("{}", buffer_pool_stats()); });
 	py::bind_vector<std::vector<std::shared_ptr<Node>>>(m, "NodeVector");
 	py::bind_map<std::map<std::string, NodeVar>>(m, "MapStringNodeVar");
 	py::bind_map<std::map<std::string, NodeData>>(m, "MapStringNodeData");
@@ -117,11 +133,26 @@ MYPYBIND11_MODULE(mesh_viz, m)
 	    .def_readonly("y", &Node::y)
 	    .def_readonly("data", &Node::data)
 	    .def("get_current_var_value", &Node::get_current_var_value)
+	    .def("get_current_var_values", &Node::get_current_var_values)
+	    .def(
+	        "read_bits",
+	        [](Node& self, const NodeVar& var) {
+		        // 64 times per word, unpack with numpy.unpackbits(a.view(numpy.uint8), bitorder="little")
+		        auto bits = self.ctx->read_bits(var);
+		        return as_pyarray(bits, bits->words());
+	        })
+	    .def("signal_cache_stats", [](const Node& self) { return std::format("{}", self.ctx->cache_stats()); })
 	    .def("add_var_to_viewer", &Node::add_var_to_viewer)
+	    .def("add_vars_to_viewer", &Node::add_vars_to_viewer)
 	    .def(
 	        "add_hist",
 	        [](Node& self, const NodeVar& var, const NodeVar& sampling_var,
 	           std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge) {
+		        // read on a worker later, so mismatched files are reported here
+		        const auto& file = *var.owner_node->ctx;
+		        file.check_contains(std::array{var, sampling_var});
+		        file.check_contains(conditions);
+		        file.check_contains(masks);
 		        return self.add_hist(var, sampling_var, conditions, masks, negedge);
 	        },
 	        py::arg(), py::arg(), "conditions"_a = std::vector<NodeVar>{},
@@ -138,13 +169,14 @@ MYPYBIND11_MODULE(mesh_viz, m)
 	        "read_values",
 	        [](Node& self, const NodeVar& var, const NodeVar& sampling_var,
 	           std::vector<NodeVar> conditions = {}, std::vector<NodeVar> masks = {},
-	           bool negedge = false) {
-		        auto [a, b] =
-		            self.ctx->read_values<uint32_t>(var, sampling_var, conditions, masks, negedge);
+	           bool negedge = false, uint64_t t_begin = 0, uint64_t t_end = UINT64_MAX) {
+		        auto [a, b] = self.ctx->read_values<uint32_t>(
+		            var, sampling_var, conditions, masks, negedge, t_begin, t_end);
 		        return std::make_pair(as_pyarray(std::move(a)), as_pyarray(std::move(b)));
 	        },
 	        py::arg(), py::arg(), "conditions"_a = std::vector<NodeVar>{},
-	        "masks"_a = std::vector<NodeVar>{}, "negedge"_a = false)
+	        "masks"_a = std::vector<NodeVar>{}, "negedge"_a = false, "t_begin"_a = 0,
+	        "t_end"_a = UINT64_MAX)
 	    .def_readonly("system_config", &Node::system_config)
 	    .def_readonly("role", &Node::role)
 	    .def("enqueue_task", &Node::enqueue_task);
@@ -155,10 +187,10 @@ MYPYBIND11_MODULE(mesh_viz, m)
 	        "read_values",
 	        [](std::shared_ptr<AsyncNode> self, const NodeVar& var, const NodeVar& sampling_var,
 	           std::vector<NodeVar> conditions = {}, std::vector<NodeVar> masks = {},
-	           bool negedge = false) {
+	           bool negedge = false, uint64_t t_begin = 0, uint64_t t_end = UINT64_MAX) {
 		        return Awaitable::create(
 		            [=]() {
-			            auto res = self->ctx.read_values<uint32_t>(var, sampling_var, conditions, masks, negedge);
+			            auto res = self->ctx.read_values<uint32_t>(var, sampling_var, conditions, masks, negedge, t_begin, t_end);
 						return res;
 		            },
 		            [](auto result) {
@@ -167,7 +199,8 @@ MYPYBIND11_MODULE(mesh_viz, m)
 		            });
 	        },
 	        py::arg(), py::arg(), "conditions"_a = std::vector<NodeVar>{},
-	        "masks"_a = std::vector<NodeVar>{}, "negedge"_a = false);
+	        "masks"_a = std::vector<NodeVar>{}, "negedge"_a = false, "t_begin"_a = 0,
+	        "t_end"_a = UINT64_MAX);
 
 	// TODO(robin): does this have to be a shared_ptr?
 	py::class_<Awaitable, std::shared_ptr<Awaitable>>(m, "Awaitable")
@@ -0,0 +1,32 @@
+#include "bit_vector.h"
+
+#include <algorithm>
+
+void BitVector::set(size_t begin, size_t end, bool value)
+{
+	end = std::min(end, bits);
+	if (begin >= end) {
+		return;
+	}
+	auto first = begin / 64;
+	auto last = (end - 1) / 64;
+	auto first_mask = ~uint64_t(0) << (begin % 64);
+	auto last_mask = ~uint64_t(0) >> (63 - (end - 1) % 64);
+	auto set_word = [&](size_t i, uint64_t mask) {
+		data[i] = value ? data[i] | mask : data[i] & ~mask;
+	};
+	if (first == last) {
+		set_word(first, first_mask & last_mask);
+		return;
+	}
+	set_word(first, first_mask);
+	std::fill(data.begin() + first + 1, data.begin() + last, value ? ~uint64_t(0) : 0);
+	set_word(last, last_mask);
+}
+
+void BitVector::unpack(uint8_t* out) const
+{
+	for (size_t i = 0; i < bits; i++) {
+		out[i] = get(i);
+	}
+}
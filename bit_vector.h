@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// one bit per tick, 64 ticks per word: tick i is bit i % 64 of word i / 64. The bits past size()
+// in the last word are always zero.
+class BitVector
+{
+public:
+	BitVector(size_t size = 0) : bits(size), data((size + 63) / 64, 0) {}
+
+	size_t size() const
+	{
+		return bits;
+	}
+
+	std::span<const uint64_t> words() const
+	{
+		return data;
+	}
+
+	bool get(size_t i) const
+	{
+		return (data[i / 64] >> (i % 64)) & 1;
+	}
+
+	// sets the ticks in [begin, end)
+	void set(size_t begin, size_t end, bool value);
+
+	// one byte per tick, 0 or 1
+	void unpack(uint8_t* out) const;
+
+private:
+	size_t bits;
+	std::vector<uint64_t> data;
+};
@@ -0,0 +1,101 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace {
+std::atomic<uint64_t> acquisitions{0};
+std::atomic<uint64_t> reuses{0};
+std::atomic<uint64_t> bytes{0};
+std::atomic<uint64_t> peak_bytes{0};
+
+// buffers left behind by exited threads
+std::mutex shared_mutex;
+std::vector<impl::BufferPool::Buffer> shared_free;
+
+size_t max_shared_free()
+{
+	return 2 * std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+void grow(impl::BufferPool::Buffer& buffer, size_t n)
+{
+	bytes -= buffer.capacity;
+	buffer.data.reset(new uint8_t[n]);
+	buffer.capacity = n;
+	auto now = bytes += n;
+	auto peak = peak_bytes.load();
+	while (now > peak and not peak_bytes.compare_exchange_weak(peak, now)) {
+	}
+}
+}
+
+BufferPoolStats buffer_pool_stats()
+{
+	return {
+	    .acquisitions = acquisitions,
+	    .reuses = reuses,
+	    .bytes = bytes,
+	    .peak_bytes = peak_bytes,
+	};
+}
+
+namespace impl {
+
+BufferPool& BufferPool::local()
+{
+	thread_local BufferPool pool;
+	return pool;
+}
+
+BufferPool::~BufferPool()
+{
+	std::lock_guard lock(shared_mutex);
+	for (auto& buffer : free) {
+		if (shared_free.size() < max_shared_free()) {
+			shared_free.push_back(std::move(buffer));
+		} else {
+			bytes -= buffer.capacity;
+		}
+	}
+}
+
+BufferPool::Lease BufferPool::acquire(size_t n)
+{
+	acquisitions++;
+
+	auto& free = local().free;
+	Buffer buffer;
+	if (not free.empty()) {
+		buffer = std::move(free.back());
+		free.pop_back();
+	} else {
+		std::lock_guard lock(shared_mutex);
+		if (not shared_free.empty()) {
+			// the largest one, so big signals don't keep regrowing small buffers
+			auto it = std::max_element(
+			    shared_free.begin(), shared_free.end(),
+			    [](const auto& a, const auto& b) { return a.capacity < b.capacity; });
+			buffer = std::move(*it);
+			shared_free.erase(it);
+		}
+	}
+
+	if (buffer.capacity >= n) {
+		reuses++;
+	} else {
+		grow(buffer, n);
+	}
+	return Lease(std::move(buffer));
+}
+
+BufferPool::Lease::~Lease()
+{
+	if (buffer.data) {
+		BufferPool::local().free.push_back(std::move(buffer));
+	}
+}
+
+}
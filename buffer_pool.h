@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <vector>
+
+struct BufferPoolStats
+{
+	uint64_t acquisitions;
+	// acquisitions served by an already allocated buffer of sufficient size
+	uint64_t reuses;
+	// bytes currently held by all pools, leased or free
+	uint64_t bytes;
+	uint64_t peak_bytes;
+};
+
+BufferPoolStats buffer_pool_stats();
+
+namespace impl {
+
+// scratch buffers for decompression. Every thread keeps a free list; buffers of exiting threads
+// (the std::async workers are short lived) go to a small shared list, so they survive across
+// blocks and reads.
+class BufferPool
+{
+public:
+	struct Buffer
+	{
+		std::unique_ptr<uint8_t[]> data;
+		size_t capacity = 0;
+	};
+
+	// returns the buffer to the pool of the releasing thread
+	class Lease
+	{
+	public:
+		Lease(Buffer buffer) : buffer(std::move(buffer)) {}
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+		~Lease();
+
+		uint8_t* data() const
+		{
+			return buffer.data.get();
+		}
+
+	private:
+		Buffer buffer;
+	};
+
+	~BufferPool();
+
+	// buffer of at least `n` bytes, the contents are uninitialized
+	static Lease acquire(size_t n);
+
+private:
+	std::vector<Buffer> free;
+
+	static BufferPool& local();
+};
+
+}
+
+template <>
+struct std::formatter<BufferPoolStats, char>
+{
+	constexpr auto parse(std::format_parse_context& ctx)
+	{
+		return ctx.begin();
+	}
+
+	auto format(const auto& s, auto& ctx) const
+	{
+		return std::format_to(
+		    ctx.out(), "{} acquisitions, {:.1f}% reused, {:.1f}MiB held, {:.1f}MiB peak",
+		    s.acquisitions, s.acquisitions ? 100.0 * s.reuses / s.acquisitions : 0.0,
+		    s.bytes / (1024.0 * 1024.0), s.peak_bytes / (1024.0 * 1024.0));
+	}
+};
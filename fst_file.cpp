@@ -6,175 +6,362 @@
 #include <print>
 #include <execution>
 #include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
 
 char* FstFile::get_value_at(const NodeVar & var, uint64_t time) const
 {
 	// TODO(robin): very crude check for unitited buffer
 	if (value_buffer.size() == 0) {
 		return nullptr;
+	} else if (fast_reader.value_at(var.handle - 1, time, value_buffer.data())) {
+		return value_buffer.data();
 	} else {
-		return fstReaderGetValueFromHandleAtTime(reader, time, var.handle, value_buffer.data());
+		auto [segment, time_offset] = fast_reader.segment_at(time);
+		return core->libfst_value_at(segment, var.handle, time - time_offset, value_buffer.data());
 	}
 }
 
+char* FstFile::get_current_value(const NodeVar & var, uint64_t time) const
+{
+	if (value_buffer.size() == 0) {
+		return nullptr;
+	}
+	// seeking first, so a var watched for the first time is added to the loaded block
+	cursor.seek(time);
+	auto slot = cursor.watch(var.handle - 1);
+	// reals are not tracked by the cursor
+	if (not slot) {
+		return get_value_at(var, time);
+	}
+	auto value = cursor.value(*slot);
+	if (value == nullptr) {
+		return get_value_at(var, time);
+	}
+	std::strcpy(value_buffer.data(), value);
+	return value_buffer.data();
+}
+
+std::vector<std::string> FstFile::snapshot(std::span<const NodeVar> vars, uint64_t time) const
+{
+	std::vector<uint32_t> facids;
+	facids.reserve(vars.size());
+	for (const auto& var : vars) {
+		facids.push_back(var.handle - 1);
+	}
+	auto snapshot = fast_reader.snapshot(time, facids);
+
+	std::vector<std::string> values;
+	values.reserve(vars.size());
+	for (size_t i = 0; i < vars.size(); i++) {
+		if (auto value = snapshot.value(i)) {
+			values.emplace_back(value);
+		} else if (auto value = get_value_at(vars[i], time)) {
+			values.emplace_back(value);
+		} else {
+			values.emplace_back();
+		}
+	}
+	return values;
+}
+
 uint64_t FstFile::max_time() const
 {
-	return fstReaderGetEndTime(reader);
+	return fast_reader.end_time();
 }
 
 uint64_t FstFile::min_time() const
 {
-	return fstReaderGetStartTime(reader);
+	return fast_reader.start_time();
 }
 
-std::vector<std::shared_ptr<Node>> FstFile::read_nodes(WaveformViewer * waveform_viewer, Histograms * histograms, AsyncRunner * async_runner)
+bool FstFile::has_hierarchy() const
 {
-	std::vector<std::shared_ptr<Node>> nodes;
+	return fast_reader.has_hierarchy();
+}
 
-	fstReaderIterateHierRewind(reader);
+size_t FstFile::num_blocks() const
+{
+	return fast_reader.num_blocks();
+}
 
-	fstHier* hier;
+uint32_t FstFile::file_id() const
+{
+	return static_cast<uint32_t>(fast_reader.file_id());
+}
 
-	bool next_is_node = false;
-	bool in_node_scope = false;
-	int depth = 0;
+bool FstFile::contains(const NodeVar & var) const
+{
+	return var.file_id == file_id();
+}
 
-	std::vector<std::string> hierarchy_stack;
-	decltype(Node::role) node_role;
-	decltype(Node::system_config) system_config;
-	auto node = std::make_shared<Node>(0, 0, NodeData{}, shared_from_this(), node_role, system_config, waveform_viewer, histograms, async_runner);
-	NodeData* current_node_data;
-	uint32_t max_bits = 0;
+void FstFile::check_contains(std::span<const NodeVar> vars) const
+{
+	for (const auto& var : vars) {
+		if (not contains(var)) {
+			throw std::invalid_argument(std::format("{} is not in {}", var.pretty_name(), core->filename));
+		}
+	}
+}
+
+uint64_t FstFile::read_cost(const NodeVar & var) const
+{
+	return fast_reader.compressed_size(var.handle - 1);
+}
+
+CacheStats FstFile::cache_stats() const
+{
+	return core->cache.stats();
+}
+
+namespace {
+bool is_comment(const FstHierRecord& record)
+{
+	return record.kind == FstHierKind::AttrBegin and record.typ == FST_AT_MISC and
+	       record.subtype == FST_MT_COMMENT;
+}
+
+auto parse_comment(const FstHierRecord& record)
+{
+	using SystemConfigT = decltype(Node::system_config);
+	// the name is null terminated, it points into the decompressed hierarchy
+	return parse_attr<
+	    ParamsWrap<decltype(SystemConfigT::node_params)>,
+	    ParamsWrap<decltype(SystemConfigT::event_params)>,
+	    ParamsWrap<decltype(SystemConfigT::error_params)>
+		>(record.name.data());
+}
+
+// builds the scopes and vars of one node from the records inside its scope, returns the widest var
+uint64_t build_node_data(const std::shared_ptr<Node>& node, std::span<const FstHierRecord> records)
+{
+	std::vector<NodeData*> scopes{&node->data};
+	uint64_t max_bits = 0;
 	std::shared_ptr<Formatter> formatter{new HexFormatter{}};
 	decltype(NodeVar::attrs) var_attrs;
 
-	while ((hier = fstReaderIterateHier(reader))) {
-		// std::println("hier {}", (void *) hier);
-		switch (hier->htyp) {
-			case FST_HT_SCOPE: {
-				// std::println("hier: {}", hier->u.scope.name);
-				if (in_node_scope) {
-					depth++;
-
-					auto scope = hier->u.scope;
-					hierarchy_stack.push_back({scope.name});
-					current_node_data =
-					    &current_node_data->subscopes.try_emplace({scope.name}).first->second;
-				}
-				if (next_is_node) {
-					next_is_node = false;
-					node->role = node_role;
-					node->system_config = system_config;
-					in_node_scope = true;
-					depth = 1;
-				}
-
+	for (const auto& record : records) {
+		switch (record.kind) {
+			case FstHierKind::Scope: {
+				scopes.push_back(
+				    &scopes.back()->subscopes.try_emplace(std::string(record.name)).first->second);
 				break;
 			}
-			case FST_HT_UPSCOPE: {
-				// std::println("hier pop");
-				if (in_node_scope) {
-					depth--;
-					if (depth == 0) {
-						nodes.push_back(node);
-						in_node_scope = false;
-					} else {
-						hierarchy_stack.pop_back();
-						current_node_data = &node->data;
-						for (const auto& name : hierarchy_stack) {
-							current_node_data = &current_node_data->subscopes.at({name});
-						}
-					}
-				}
+			case FstHierKind::Upscope: {
+				scopes.pop_back();
 				break;
 			}
-			case FST_HT_VAR: {
-				if (in_node_scope) {
-					auto var = hier->u.var;
-					// std::println("adding var {} handle {}", var.name, var.handle);
-					// TODO(robin): add formatter for single bit enums
-					if (var.length == 1) {
-						formatter.reset(new BinaryFormatter{});
-					}
-					current_node_data->variables.insert(
-					    {{var.name},
-					     {var.name, var.length, var.handle, node, std::move(formatter),
-					      var_attrs}});
-					formatter.reset(new HexFormatter{});
-					max_bits = max_bits > var.length ? max_bits : var.length;
+			case FstHierKind::Var: {
+				// TODO(robin): add formatter for single bit enums
+				if (record.length == 1) {
+					formatter.reset(new BinaryFormatter{});
 				}
-				// std::println("[var]: name: {}", hier->u.var.name);
+				scopes.back()->variables.insert(
+				    {std::string(record.name),
+				     {std::string(record.name), record.length, record.handle, node->ctx->file_id(), node,
+				      std::move(formatter), std::move(var_attrs)}});
+				formatter.reset(new HexFormatter{});
+				var_attrs.clear();
+				max_bits = std::max(max_bits, record.length);
 				break;
 			}
-			case FST_HT_ATTRBEGIN: {
-				auto attr = hier->u.attr;
-				if (attr.typ == FST_AT_MISC and attr.subtype == FST_MT_COMMENT) {
-					// std::println("found comment: {}", attr.name);
-					using SystemConfigT = decltype(Node::system_config);
-					auto parsed = parse_attr<
-					    ParamsWrap<decltype(SystemConfigT::node_params)>,
-					    ParamsWrap<decltype(SystemConfigT::event_params)>,
-					    ParamsWrap<decltype(SystemConfigT::error_params)>
-						>(attr.name);
-					auto nodeattr = std::get_if<NodeAttr>(&parsed);
-					if (nodeattr) {
-						assert(not in_node_scope);
-						next_is_node = true;
-						node = std::make_shared<Node>(nodeattr->x, nodeattr->y, NodeData{}, shared_from_this(), node_role, system_config, waveform_viewer, histograms, async_runner);
-						current_node_data = &node->data;
-					}
-					auto signalattr = std::get_if<SignalAttr>(&parsed);
-					if (signalattr) {
-						if (signalattr->name == "formatter") {
-							formatter.reset(new FixedFormatter{
-							    parse_formatter(std::get<std::string>(signalattr->value))});
-						}
-						SignalAttr attr = *signalattr;
-						var_attrs.insert({attr.name, attr.value});
-					}
-					auto system_attr = std::get_if<decltype(Node::system_config)>(&parsed);
-					if (system_attr) {
-						system_config = *system_attr;
-					}
-					auto node_role_attr = std::get_if<decltype(Node::role)>(&parsed);
-					if (node_role_attr) {
-						// std::println("parsed node role");
-						node_role = *node_role_attr;
+			case FstHierKind::AttrBegin: {
+				if (not is_comment(record)) {
+					break;
+				}
+				auto parsed = parse_comment(record);
+				assert(not std::get_if<NodeAttr>(&parsed));
+				auto signalattr = std::get_if<SignalAttr>(&parsed);
+				if (signalattr) {
+					if (signalattr->name == "formatter") {
+						formatter.reset(new FixedFormatter{
+						    parse_formatter(std::get<std::string>(signalattr->value))});
 					}
-					// std::visit([](auto v) {
-					//     std::println("[attr]: {}", v);
-					// }, );
+					var_attrs.insert({signalattr->name, signalattr->value});
 				}
 				break;
 			}
-			case FST_HT_ATTREND: {
-				// std::println("[attr]: end");
+			case FstHierKind::AttrEnd: {
 				break;
 			}
 		}
 	}
+	return max_bits;
+}
+}
 
+std::vector<std::shared_ptr<Node>> FstFile::read_nodes(WaveformViewer * waveform_viewer, Histograms * histograms, AsyncRunner * async_runner, size_t threads)
+{
+	auto hierarchy = fast_reader.read_hierarchy();
+	const auto& records = hierarchy.records;
+
+	// a node is the scope following a node attribute. Finding them is a cheap serial pass, the
+	// records inside are turned into NodeData in parallel.
+	struct NodeRecords
+	{
+		std::shared_ptr<Node> node;
+		size_t begin, end;
+	};
+	std::vector<NodeRecords> node_records;
 
-	// values .insert(values.end(), time - last_time - 1, values.last());
-	value_buffer.assign(max_bits + 1, 0);
+	decltype(Node::role) node_role;
+	decltype(Node::system_config) system_config;
+	std::shared_ptr<Node> next_node;
+
+	for (size_t i = 0; i < records.size(); i++) {
+		const auto& record = records[i];
+		if (record.kind == FstHierKind::Scope and next_node) {
+			next_node->role = node_role;
+			next_node->system_config = system_config;
+
+			size_t depth = 1;
+			size_t end = i + 1;
+			for (; end < records.size(); end++) {
+				depth += records[end].kind == FstHierKind::Scope;
+				depth -= records[end].kind == FstHierKind::Upscope;
+				if (depth == 0) {
+					break;
+				}
+			}
+			// an unterminated node is dropped
+			if (depth == 0) {
+				node_records.push_back({std::move(next_node), i + 1, end});
+			}
+			next_node = nullptr;
+			i = end;
+		} else if (is_comment(record)) {
+			auto parsed = parse_comment(record);
+			auto nodeattr = std::get_if<NodeAttr>(&parsed);
+			if (nodeattr) {
+				next_node = std::make_shared<Node>(nodeattr->x, nodeattr->y, NodeData{}, shared_from_this(), node_role, system_config, waveform_viewer, histograms, async_runner);
+			}
+			auto system_attr = std::get_if<decltype(Node::system_config)>(&parsed);
+			if (system_attr) {
+				system_config = *system_attr;
+			}
+			auto node_role_attr = std::get_if<decltype(Node::role)>(&parsed);
+			if (node_role_attr) {
+				node_role = *node_role_attr;
+			}
+		}
+	}
+
+	std::vector<uint64_t> max_bits(node_records.size());
+	impl::parallel_for(node_records.size(), threads, [&](size_t i) {
+		auto& [node, begin, end] = node_records[i];
+		max_bits[i] = build_node_data(node, std::span(records).subspan(begin, end - begin));
+	});
+
+	std::vector<std::shared_ptr<Node>> nodes;
+	nodes.reserve(node_records.size());
+	for (auto& node_record : node_records) {
+		nodes.push_back(std::move(node_record.node));
+	}
+
+	uint64_t widest = 0;
+	for (auto bits : max_bits) {
+		widest = std::max(widest, bits);
+	}
+	value_buffer.assign(widest + 1, 0);
 	return nodes;
 }
 
-FstFile::FstFile(const char* path) : reader(fstReaderOpen(path)), filename(path), cache(25), fast_reader(path) {}
+FstFileCore::FstFileCore(std::span<const std::string> paths, size_t cache_bytes) :
+    filename(paths.front()),
+    segment_paths(paths.begin(), paths.end()),
+    cache(cache_bytes),
+    // the index only covers single files
+    index(paths.size() == 1 ? MvIndex::open(filename) : nullptr),
+    libfst_readers(paths.size(), nullptr)
+{
+}
 
-FstFile::FstFile(const FstFile& other) :
-    reader(fstReaderOpen(other.filename.c_str())),
-    filename(other.filename),
-    value_buffer(other.value_buffer),
-	cache(5),
-	fast_reader(other.fast_reader)
+FstFileCore::~FstFileCore()
 {
-	// std::println("copied");
+	for (auto reader : libfst_readers) {
+		if (reader) {
+			fstReaderClose(reader);
+		}
+	}
+}
+
+char* FstFileCore::libfst_value_at(size_t segment, handle_t handle, uint64_t time, char* buffer)
+{
+	std::lock_guard lock(libfst_mutex);
+	auto& reader = libfst_readers[segment];
+	if (not reader) {
+		reader = fstReaderOpen(segment_paths[segment].c_str());
+	}
+	return fstReaderGetValueFromHandleAtTime(reader, time, handle, buffer);
+}
+
+namespace {
+FstReader open_reader(
+    std::span<const std::string> paths, std::shared_ptr<const MvIndex> index, size_t threads)
+{
+	if (paths.size() == 1) {
+		return FstReader(
+		    paths[0].c_str(), FstReader::DEFAULT_TIME_TABLE_CACHE_BYTES, index, threads);
+	}
+	return FstReader(paths, FstReader::DEFAULT_TIME_TABLE_CACHE_BYTES, threads);
+}
 }
 
-FstFile::~FstFile()
+FstFile::FstFile(const char* path, size_t cache_bytes) :
+    FstFile(std::array{std::string(path)}, cache_bytes)
+{
+}
+
+FstFile::FstFile(std::span<const std::string> paths, size_t cache_bytes, size_t threads) :
+    core(std::make_shared<FstFileCore>(paths, cache_bytes)),
+    fast_reader(open_reader(paths, core->index, threads)),
+    cursor(fast_reader)
+{
+}
+
+void FstFile::save_index(const std::map<handle_t, WaveDatabase*>& dbs) const
+{
+	if (fast_reader.num_segments() > 1) {
+		return;
+	}
+	const auto& index = core->index;
+	// nothing new since the index was read
+	if (index and std::ranges::all_of(dbs, [&](const auto& db) {
+		    return index->wave_db(db.first).has_value();
+	    })) {
+		return;
+	}
+
+	std::map<uint32_t, MvIndex::Db> to_save;
+	if (index) {
+		for (auto handle : index->handles()) {
+			if (auto db = index->wave_db(handle)) {
+				to_save.emplace(handle, *db);
+			}
+		}
+	}
+	// packed only now, there is no second copy of the values while the databases are in use
+	std::map<uint32_t, std::vector<uint32_t>> packed;
+	for (const auto& [handle, db] : dbs) {
+		auto& values = packed[handle];
+		values.reserve(db->size());
+		for (uint32_t i = 0; i < db->size(); i++) {
+			values.push_back(db->get(i).pack());
+		}
+		db->rewind();
+		to_save.insert_or_assign(handle, MvIndex::Db{uint8_t(db->kind()), values});
+	}
+	fast_reader.save_index(to_save);
+}
+
+FstFile::FstFile(const FstFile& other) :
+    core(other.core),
+    value_buffer(other.value_buffer),
+	fast_reader(other.fast_reader),
+	cursor(fast_reader)
 {
-	fstReaderClose(reader);
 }
 
 bool all_zero(const byte_t* vals, uint16_t bytes)
@@ -187,8 +374,32 @@ bool all_zero(const byte_t* vals, uint16_t bytes)
 	return true;
 }
 
+namespace {
+std::optional<WaveDatabase> indexed_db(const FstFileCore& core, handle_t handle)
+{
+	const auto& index = core.index;
+	if (not index) {
+		return std::nullopt;
+	}
+	auto db = index->wave_db(handle);
+	if (not db or db->kind >= std::variant_size_v<decltype(WaveDatabase::the_db)>) {
+		return std::nullopt;
+	}
+	std::vector<WaveValue> values;
+	values.reserve(db->values.size());
+	for (auto v : db->values) {
+		values.push_back(WaveValue::unpack(v));
+	}
+	return WaveDatabase::with_kind(values, db->kind);
+}
+}
+
 WaveDatabase FstFile::read_wave_db(NodeVar var) const
 {
+	if (auto db = indexed_db(*core, var.handle)) {
+		return std::move(*db);
+	}
+
 	std::vector<WaveValue> values;
 	fast_reader.read_values(var.handle - 1,
 	    [&](uint32_t time, const unsigned char* value, uint16_t bytes) {
@@ -199,6 +410,59 @@ WaveDatabase FstFile::read_wave_db(NodeVar var) const
 	return WaveDatabase(values);
 }
 
+std::vector<WaveDatabase> FstFile::read_wave_dbs(std::span<const NodeVar> vars) const
+{
+	std::vector<std::optional<WaveDatabase>> indexed;
+	std::vector<NodeVar> to_read;
+	for (const auto& var : vars) {
+		indexed.push_back(indexed_db(*core, var.handle));
+		if (not indexed.back()) {
+			to_read.push_back(var);
+		}
+	}
+	auto values = read_wave_values(to_read);
+
+	std::vector<WaveDatabase> dbs;
+	dbs.reserve(vars.size());
+	size_t read_idx = 0;
+	for (size_t i = 0; i < vars.size(); i++) {
+		if (indexed[i]) {
+			dbs.push_back(std::move(*indexed[i]));
+		} else {
+			dbs.emplace_back(values[read_idx++]);
+		}
+	}
+	return dbs;
+}
+
+std::vector<std::vector<WaveValue>> FstFile::read_wave_values(std::span<const NodeVar> vars, size_t first_block) const
+{
+	std::vector<uint32_t> facids;
+	std::unordered_map<uint32_t, size_t> facid_to_idx;
+	for (const auto& var : vars) {
+		auto [_, inserted] = facid_to_idx.emplace(var.handle - 1, facids.size());
+		if (inserted) {
+			facids.push_back(var.handle - 1);
+		}
+	}
+
+	std::vector<std::vector<WaveValue>> values(facids.size());
+	fast_reader.read_values(
+	    facids, [&](uint32_t facid, uint32_t time, const unsigned char* value, uint16_t bytes) {
+		    values[facid_to_idx.at(facid)].push_back(WaveValue{
+		        static_cast<uint32_t>(time),
+		        all_zero(value, bytes) ? WaveValueType::Zero : WaveValueType::NonZero});
+	    },
+	    first_block);
+
+	std::vector<std::vector<WaveValue>> ret;
+	ret.reserve(vars.size());
+	for (const auto& var : vars) {
+		ret.push_back(values[facid_to_idx.at(var.handle - 1)]);
+	}
+	return ret;
+}
+
 // template<typename T>
 // void from_chars(const char * start, const char * end, T & result) {
 // 	std::from_chars(start, end, result, 2);
@@ -216,50 +480,79 @@ T from_bytes(const byte_t* data) {
 
 // TODO(robin): do caching? or multithreading?
 template <class T, class O>
-O FstFile::read_values(const NodeVar & var) const
+O FstFile::read_values(const NodeVar & var, uint64_t t_begin, uint64_t t_end) const
 {
+	if constexpr (std::is_same<O, std::valarray<bit_type_t>>()) {
+		// only full reads of single bits are cached, windows are cheap enough to redo
+		if (var.nbits == 1 and t_begin == 0 and t_end >= max_time()) {
+			auto bits = read_bits(var);
+			O values(bits->size());
+			bits->unpack(std::begin(values));
+			return values;
+		}
+	}
+
 	auto bytes = (var.nbits + 7) / 8;
 	switch (bytes) {
 		case 1:
-			return read_values_inner<T, O, 1>(var);
+			return read_values_inner<T, O, 1>(var, t_begin, t_end);
 		case 2:
-			return read_values_inner<T, O, 2>(var);
+			return read_values_inner<T, O, 2>(var, t_begin, t_end);
 		case 3:
-			return read_values_inner<T, O, 3>(var);
+			return read_values_inner<T, O, 3>(var, t_begin, t_end);
 		case 4:
-			return read_values_inner<T, O, 4>(var);
+			return read_values_inner<T, O, 4>(var, t_begin, t_end);
 		case 5:
-			return read_values_inner<T, O, 5>(var);
+			return read_values_inner<T, O, 5>(var, t_begin, t_end);
 		case 6:
-			return read_values_inner<T, O, 6>(var);
+			return read_values_inner<T, O, 6>(var, t_begin, t_end);
 		case 7:
-			return read_values_inner<T, O, 7>(var);
+			return read_values_inner<T, O, 7>(var, t_begin, t_end);
 		case 8:
-			return read_values_inner<T, O, 8>(var);
+			return read_values_inner<T, O, 8>(var, t_begin, t_end);
 		default:
-			return read_values_inner<T, O>(var);
+			return read_values_inner<T, O>(var, t_begin, t_end);
 	}
 }
 
-// TODO(robin): do caching? or multithreading?
+std::shared_ptr<const BitVector> FstFile::read_bits(const NodeVar & var) const
+{
+	SignalKey key{var.handle, max_time()};
+	if (auto cached = core->cache.get(key)) {
+		return cached;
+	}
+	auto bits = std::make_shared<BitVector>(max_time() + 1);
+	// filled run by run, so this is proportional to the changes plus the words
+	uint64_t run_begin = 0;
+	bool run_value = false;
+	fast_reader.read_values(var.handle - 1, [&](uint32_t time, const byte_t* data, uint16_t bytes) {
+		bits->set(run_begin, time, run_value);
+		run_begin = time;
+		run_value = not all_zero(data, bytes);
+	});
+	bits->set(run_begin, bits->size(), run_value);
+	core->cache.add(key, bits, bits->words().size_bytes());
+	return bits;
+}
+
+// TODO(robin): multithreading?
 template <class T, class O, int nbytes>
-O FstFile::read_values_inner(const NodeVar & var) const
+O FstFile::read_values_inner(const NodeVar & var, uint64_t t_begin, uint64_t t_end) const
 {
-	if constexpr (std::is_same<T, bit_type_t>()) {
-		auto cached = cache.get(var.handle);
-		if (cached) {
-			// std::println("cache hit");
-			return *cached;
-		}
+	t_end = std::min(t_end, max_time());
+	bool full = t_begin == 0 and t_end == max_time();
+
+	if (t_begin > t_end) {
+		return O{};
 	}
 
-	O values(max_time() - min_time() + 1);
+	O values(full ? max_time() - min_time() + 1 : t_end - t_begin + 1);
 	// std::println("values.size(): {}", values.size());
 	// values.reserve();
 	int64_t last_time = -1;
 	auto shift = (8 - (var.nbits % 8)) % 8;
-	fast_reader.read_values(
-	    var.handle - 1, [&](uint32_t time, const byte_t* data, uint16_t bytes) {
+	auto on_change = [&](uint32_t abs_time, const byte_t* data, uint16_t bytes) {
+		    int64_t time = int64_t(abs_time) - int64_t(t_begin);
 		    T v{0};
 			if constexpr(nbytes == 0) {
 				for (int i = 0; i < bytes; i++) {
@@ -284,76 +577,126 @@ O FstFile::read_values_inner(const NodeVar & var) const
 			    // values.push_back(v);
 		    }
 		    last_time = time;
-	    });
+	    };
 
-	if (last_time < max_time()) {
-		std::fill(std::execution::unseq, std::begin(values) + last_time + 1, std::begin(values) + max_time(), values[last_time]);
-		// values.insert(values.end(), max_time() - last_time - 1, values.back());
-	}
-
-	if constexpr (std::is_same<T, bit_type_t>()) {
-		cache.add(var.handle, values);
+	if (full) {
+		fast_reader.read_values(var.handle - 1, on_change);
+		if (last_time < max_time()) {
+			std::fill(std::execution::unseq, std::begin(values) + last_time + 1, std::begin(values) + max_time(), values[last_time]);
+			// values.insert(values.end(), max_time() - last_time - 1, values.back());
+		}
+	} else {
+		fast_reader.read_values(var.handle - 1, t_begin, t_end, on_change);
+		if (last_time != -1) {
+			std::fill(std::execution::unseq, std::begin(values) + last_time + 1, std::end(values), values[last_time]);
+		}
 	}
 
 	return std::move(values);
 }
 
+namespace {
+// the changes of a var in a window, the value at a time is the one of the last change at or before
+// it. Queried with monotonically increasing times.
 template <class T>
-std::pair<std::vector<simtime_t>, std::vector<T>> FstFile::read_values(const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge) const
+struct ChangeList
 {
-	auto var_data = read_values<T, std::valarray<T>>(var);
-	auto clk = read_values<bit_type_t, std::valarray<bit_type_t>>(sampling_var);
-
-	// std::vector<std::vector<bit_type_t>> condition_data(conditions.size());
-	// std::vector<std::vector<bit_type_t>> mask_data(masks.size());
-
-	std::valarray<bit_type_t> cond(true, var_data.size());
-	std::valarray<bit_type_t> mask(false, var_data.size());
-
-	for (size_t i = 0; i < conditions.size(); i++) {
-		cond *= read_values<bit_type_t, std::valarray<bit_type_t>>(conditions[i]);
-	}
-	for (size_t i = 0; i < masks.size(); i++) {
-		mask |= read_values<bit_type_t, std::valarray<bit_type_t>>(masks[i]);
+	std::vector<uint64_t> times;
+	std::vector<T> values;
+	size_t pos = 0;
+	T current{0};
+
+	T at(uint64_t time)
+	{
+		while (pos < times.size() and times[pos] <= time) {
+			current = values[pos++];
+		}
+		return current;
 	}
-	cond *= (1 - mask);
-
-	auto num_entries = var_data.size();
-	// std::valarray<bit_type_t> tmp2(false, var_data.size());
+};
 
-	// std::copy(std::execution::unseq, sampling_var_data.begin(), sampling_var_data.end(), std::begin(tmp));
-	// std::copy(std::execution::unseq, sampling_var_data.begin(), sampling_var_data.end(), std::begin(tmp2));
+template <class T>
+ChangeList<T> read_changes(const FstReader& reader, const NodeVar& var, uint64_t t_begin, uint64_t t_end)
+{
+	ChangeList<T> changes;
+	auto shift = (8 - (var.nbits % 8)) % 8;
+	reader.read_values(var.handle - 1, t_begin, t_end, [&](uint32_t time, const byte_t* data, uint16_t bytes) {
+		T v{0};
+		for (int i = 0; i < bytes; i++) {
+			v <<= 8;
+			v |= data[i];
+		}
+		changes.times.push_back(time);
+		changes.values.push_back(v >> shift);
+	});
+	return changes;
+}
+}
 
-	clk[std::slice(1, num_entries - 1, 1)] &= (1 - clk)[std::slice(0, num_entries - 1, 1)];
+template <class T>
+std::pair<std::vector<simtime_t>, std::vector<T>> FstFile::read_values(const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge, uint64_t t_begin, uint64_t t_end) const
+{
+	check_contains(std::array{var, sampling_var});
+	check_contains(conditions);
+	check_contains(masks);
+
+	t_end = std::min(t_end, max_time());
+	// start one step early, so an edge right at t_begin is still detected
+	auto window_begin = t_begin > 0 ? t_begin - 1 : 0;
+	if (window_begin > t_end) {
+		return {};
+	}
 
-	if (negedge) {
-		cond &= 1 - clk;
-	} else {
-		cond &= clk;
+	// only the changes are read, so this scales with the number of changes and edges instead of
+	// the length of the window
+	auto var_data = read_changes<T>(fast_reader, var, window_begin, t_end);
+	auto clk = read_changes<uint64_t>(fast_reader, sampling_var, window_begin, t_end);
+	std::vector<ChangeList<uint64_t>> condition_data;
+	for (const auto& condition : conditions) {
+		condition_data.push_back(read_changes<uint64_t>(fast_reader, condition, window_begin, t_end));
+	}
+	std::vector<ChangeList<uint64_t>> mask_data;
+	for (const auto& mask : masks) {
+		mask_data.push_back(read_changes<uint64_t>(fast_reader, mask, window_begin, t_end));
 	}
-	cond[0] = 0;
 
-	uint64_t count = std::reduce(std::execution::unseq, std::begin(cond), std::end(cond), 0UL);
+	std::vector<simtime_t> times;
+	std::vector<T> values;
+	bool last_clk = false;
+	for (size_t i = 0; i < clk.times.size(); i++) {
+		auto time = clk.times[i];
+		// several changes at one time, only the final one counts
+		if (i + 1 < clk.times.size() and clk.times[i + 1] == time) {
+			continue;
+		}
+		bool now_clk = clk.values[i] != 0;
+		bool edge = negedge ? (last_clk and not now_clk) : (now_clk and not last_clk);
+		last_clk = now_clk;
+		if (not edge or time <= window_begin) {
+			continue;
+		}
 
-	std::vector<simtime_t> times(count);
-	std::vector<T> values(count);
-	auto idx = 0;
-	for (simtime_t time = 1; time < var_data.size(); time++) {
-		if (cond[time]) {
-			times[idx] = time;
-			values[idx] = var_data[time];
-			idx += 1;
+		bool sample = true;
+		for (auto& condition : condition_data) {
+			sample = sample and condition.at(time) != 0;
+		}
+		for (auto& mask : mask_data) {
+			sample = sample and mask.at(time) == 0;
+		}
+		if (sample) {
+			times.push_back(time);
+			values.push_back(var_data.at(time));
 		}
 	}
 
 	return std::make_pair(times, values);
 }
 
-template std::vector<uint32_t> FstFile::read_values<uint32_t>(const NodeVar & var) const;
-template std::valarray<uint32_t> FstFile::read_values<uint32_t>(const NodeVar & var) const;
-template std::valarray<FstFile::bit_type_t> FstFile::read_values<FstFile::bit_type_t>(const NodeVar & var) const;
+template std::vector<uint32_t> FstFile::read_values<uint32_t>(const NodeVar & var, uint64_t t_begin, uint64_t t_end) const;
+template std::valarray<uint32_t> FstFile::read_values<uint32_t>(const NodeVar & var, uint64_t t_begin, uint64_t t_end) const;
+template std::valarray<FstFile::bit_type_t> FstFile::read_values<FstFile::bit_type_t>(const NodeVar & var, uint64_t t_begin, uint64_t t_end) const;
 
 // template std::vector<bool> FstFile::read_values(const NodeVar & var) const;
 // template std::vector<bool> FstFile::read_values<bool, 1>(const NodeVar & var) const;
-template std::pair<std::vector<simtime_t>, std::vector<uint32_t>> FstFile::read_values(const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge) const;
+template std::pair<std::vector<simtime_t>, std::vector<uint32_t>> FstFile::read_values(const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge, uint64_t t_begin, uint64_t t_end) const;
 //
@@ -5,8 +5,12 @@
 #include "wave_data_base.h"
 #include "core.h"
 #include "lru_cache.h"
+#include "bit_vector.h"
 #include "fst_reader.h"
 
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <vector>
 
 using handle_t = fstHandle;
@@ -19,31 +23,79 @@ struct Histograms;
 struct AsyncRunner;
 struct Node;
 
-struct FstFile: public std::enable_shared_from_this<FstFile>
+// (handle, max_time) of a full dense read
+using SignalKey = std::pair<handle_t, uint64_t>;
+struct SignalKeyHash
+{
+	size_t operator()(const SignalKey& key) const
+	{
+		return std::hash<uint64_t>{}((uint64_t(key.first) << 40) ^ key.second);
+	}
+};
+using SignalCache = ShardedCache<SignalKey, BitVector, SignalKeyHash>;
+
+// the part of an FstFile shared by all its copies, safe to use from any thread
+struct FstFileCore
 {
-	using fstReader = void*;
-	fstReader reader;
+	// the first file of a time split trace
 	std::string filename;
+	// all of its files in time order, just filename for a single file
+	std::vector<std::string> segment_paths;
+	// bit packed dense reads
+	SignalCache cache;
+	// the sidecar index of the file, nullptr if there is none that matches the file
+	std::shared_ptr<const MvIndex> index;
+
+	FstFileCore(std::span<const std::string> paths, size_t cache_bytes);
+	~FstFileCore();
+
+	// the value through libfst, for what the native reader can not provide (reals and times
+	// before the first block). time is relative to the file.
+	char* libfst_value_at(size_t segment, handle_t handle, uint64_t time, char* buffer);
+
+private:
+	// opened on first use, one per segment, libfst readers are not thread safe
+	std::mutex libfst_mutex;
+	std::vector<void*> libfst_readers;
+};
+
+struct FstFile: public std::enable_shared_from_this<FstFile>
+{
+	std::shared_ptr<FstFileCore> core;
 	// value at time requires one passes in a char buffer. We can statically know
 	// how long this has to be by reading the nodes.
 	mutable std::vector<char> value_buffer;
 
 	// using bit_type_t = uint8_t;
 	using bit_type_t = uint8_t;
-	// TODO(robin): this is quite hacky
-	mutable LruCache<handle_t, std::valarray<bit_type_t>> cache;
 
+	static constexpr size_t DEFAULT_CACHE_BYTES = 1024 << 20;
+
+	// cheap to copy, the mapping, metadata and decoded time tables are shared
 	FstReader fast_reader;
 
-	~FstFile();
+	// for the values at the cursor, which mostly moves forward in small steps
+	mutable FstCursor cursor;
 
-	FstFile(const char* path);
+	FstFile(const char* path, size_t cache_bytes = DEFAULT_CACHE_BYTES);
 
-	// TODO(robin): consider making this deleted to avoid implicit copies
-	// copies the context for use on another thread for example
+	// the files of a time split trace in time order, presented as one continuous trace. The metadata
+	// is parsed on up to `threads` threads.
+	FstFile(
+	    std::span<const std::string> paths,
+	    size_t cache_bytes = DEFAULT_CACHE_BYTES,
+	    size_t threads = impl::default_parallelism());
+
+	// copies the context for use on another thread for example. Shares the core and everything
+	// decoded so far, only the cursor starts out empty.
 	FstFile(const FstFile & other);
 
-	std::vector<std::shared_ptr<Node>> read_nodes(WaveformViewer * waveform_viewer, Histograms * histograms, AsyncRunner * async_runner);
+	// no nodes before the hierarchy is written, see has_hierarchy. The nodes are built on up to
+	// `threads` threads.
+	std::vector<std::shared_ptr<Node>> read_nodes(WaveformViewer * waveform_viewer, Histograms * histograms, AsyncRunner * async_runner, size_t threads = impl::default_parallelism());
+
+	// false for a file that is still being written, the writer only adds the hierarchy on close
+	bool has_hierarchy() const;
 
 	// template<class T>
 	// void read_changes(
@@ -88,20 +140,59 @@ struct FstFile: public std::enable_shared_from_this<FstFile>
 
 	WaveDatabase read_wave_db(NodeVar var) const;
 
+	// reads all vars in one pass over the file
+	std::vector<WaveDatabase> read_wave_dbs(std::span<const NodeVar> vars) const;
+
+	// the changes of every var in the VC blocks from first_block on
+	std::vector<std::vector<WaveValue>> read_wave_values(std::span<const NodeVar> vars, size_t first_block = 0) const;
+
+	// writes the sidecar index, so the next open of this file is fast. dbs are the databases of vars
+	// of this file in memory by handle, they are saved along with the ones of the old index. Time
+	// split traces have no index.
+	void save_index(const std::map<handle_t, WaveDatabase*>& dbs) const;
+
+	size_t num_blocks() const;
+
+	uint32_t file_id() const;
+
+	// whether var is a signal of this file
+	bool contains(const NodeVar & var) const;
+
+	// throws std::invalid_argument unless all vars are signals of this file
+	void check_contains(std::span<const NodeVar> vars) const;
+
+	// estimated cost of read_wave_db(var), in compressed bytes
+	uint64_t read_cost(const NodeVar & var) const;
+
+	CacheStats cache_stats() const;
+
 	uint64_t min_time() const;
 
 	uint64_t max_time() const;
 
 	char* get_value_at(const NodeVar & var, uint64_t time) const;
 
+	// like get_value_at, but through the cursor. Only applies the changes since the last call when
+	// time moved forward a bit.
+	char* get_current_value(const NodeVar & var, uint64_t time) const;
+
+	// the values of all vars at one time, decoding every VC block chunk at most once
+	std::vector<std::string> snapshot(std::span<const NodeVar> vars, uint64_t time) const;
+
+	// dense values for every time in [t_begin, t_end], index 0 corresponds to t_begin. Only the
+	// VC blocks overlapping the window are decoded.
 	template<class T, class O = std::vector<T>>
-	O read_values(const NodeVar & var) const;
+	O read_values(const NodeVar & var, uint64_t t_begin = 0, uint64_t t_end = UINT64_MAX) const;
+
+	// one bit per time in [0, max_time], set where var is non zero. Shared with the cache instead of
+	// copied out of it.
+	std::shared_ptr<const BitVector> read_bits(const NodeVar & var) const;
 
 
 	template<class T>
-	std::pair<std::vector<simtime_t>, std::vector<T>> read_values(const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge = false) const;
+	std::pair<std::vector<simtime_t>, std::vector<T>> read_values(const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge = false, uint64_t t_begin = 0, uint64_t t_end = UINT64_MAX) const;
 
 	private:
 	template<class T, class O = std::vector<T>, int nbits = 0>
-	O read_values_inner(const NodeVar & var) const;
+	O read_values_inner(const NodeVar & var, uint64_t t_begin, uint64_t t_end) const;
 };
@@ -1,54 +1,147 @@
 #include "fst_reader.h"
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
-#include <fstream>
+#include <chrono>
+#include <cstring>
 #include <numeric>
 #include <print>
 #include <varintdecode.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 using namespace impl;
 
 namespace impl {
+// Decodes one varint with a single 8 byte load, so there have to be at least 8 readable bytes at
+// `data`. `bits` is set to the number of payload bits consumed.
+inline uint64_t read_varint_bulk(const byte_t*& data, int& bits)
+{
+	uint64_t word;
+	std::memcpy(&word, data, sizeof(word));
+	// every byte without the continuation bit terminates a varint
+	uint64_t stop = ~word & 0x8080'8080'8080'8080ULL;
+	if (stop == 0) [[unlikely]] {
+		auto start = data;
+		auto result = read_varint(data);
+		bits = 7 * (data - start);
+		return result;
+	}
+	int len = (std::countr_zero(stop) + 1) / 8;
+	bits = 7 * len;
+	uint64_t result = 0;
+#ifdef __BMI2__
+	result = _pext_u64(word, 0x7f7f'7f7f'7f7f'7f7fULL >> (64 - 8 * len));
+#else
+	for (int i = 0; i < len; i++) {
+		result |= ((word >> (8 * i)) & 0b0111'1111) << (7 * i);
+	}
+#endif
+	data += len;
+	return result;
+}
+
+inline int64_t read_svarint_bulk(const byte_t*& data)
+{
+	int bits;
+	int64_t result = read_varint_bulk(data, bits);
+	if ((bits < 64) and ((result >> (bits - 1)) & 1)) {
+		result |= -(1LL << bits);
+	}
+	return result;
+}
+
+// a read position in the mapped file
+struct MmapCursor
+{
+	const byte_t* data;
+	const byte_t* pos;
+
+	MmapCursor(const byte_t* data, uint64_t offset = 0) : data(data), pos(data + offset) {}
+
+	void seek(uint64_t offset)
+	{
+		pos = data + offset;
+	}
+
+	void skip(uint64_t bytes)
+	{
+		pos += bytes;
+	}
+
+	uint64_t tell() const
+	{
+		return pos - data;
+	}
+
+	uint64_t read_varint()
+	{
+		return ::read_varint(pos);
+	}
+
+	template <typename T>
+	T read_scalar()
+	{
+		T value{0};
+		std::memcpy(&value, pos, sizeof(T));
+		pos += sizeof(T);
+		if constexpr (std::is_same<T, float>() or std::is_same<T, double>()) {
+			return value;
+		} else {
+			return std::byteswap(value);
+		}
+	}
+};
+
+// parses the metadata directly from the mapped file. Locating the blocks is serial, decoding the
+// position tables of the VC blocks is spread over `threads` threads.
 struct FstMetadataReader
 {
-	std::ifstream file;
+	const byte_t* data;
+	uint64_t size;
+	size_t threads;
 
 	FstMetaData metadata;
 
-	FstMetadataReader(const char* path) : file(path) {
+	FstMetadataReader(const byte_t* data, uint64_t size, size_t threads, FstMetaData metadata) :
+	    data(data), size(size), threads(threads), metadata(std::move(metadata))
+	{
 		read_blocks();
 	};
 
-	FstVCBlockInfo read_dyn_alias2(FstBlock block)
+	// VCData, VCDataDynAlias and VCDataDynAlias2 share the layout, they only differ in the encoding
+	// of the position table
+	FstVCBlockInfo read_vc_block(FstBlock block) const
 	{
-		file.seekg(block.data_start());
-		auto start_time = read_scalar<uint64_t>();
-		auto end_time = read_scalar<uint64_t>();
+		MmapCursor cursor(data, block.data_start());
+		auto start_time = cursor.read_scalar<uint64_t>();
+		auto end_time = cursor.read_scalar<uint64_t>();
 		[[maybe_unused]]
-		auto memory_required = read_scalar<uint64_t>();
-		auto bits_uncompressed_length = read_varint();
-		auto bits_compressed_length = read_varint();
-		auto bits_count = read_varint();
+		auto memory_required = cursor.read_scalar<uint64_t>();
+		auto bits_uncompressed_length = cursor.read_varint();
+		auto bits_compressed_length = cursor.read_varint();
+		auto bits_count = cursor.read_varint();
+		auto bits_data_pos = cursor.tell();
 
 		// std::println("start_time {}, end_time {}, memory_required {}, bits_uncompressed_length
 		// {}, bits_compressed_length {}, bits_count {}", start_time, end_time, memory_required,
 		// bits_uncompressed_length, bits_compressed_length, bits_count);
 
-		file.seekg(bits_compressed_length, file.cur);
+		cursor.skip(bits_compressed_length);
 
-		[[maybe_unused]]
-		auto waves_count = read_varint();
-		auto wave_data_pos = file.tellg();
-		auto waves_packtype = read_scalar<uint8_t>();
-		// only zlib for now
-		assert(waves_packtype == 'Z');
+		auto waves_count = cursor.read_varint();
+		auto wave_data_pos = cursor.tell();
+		auto waves_packtype = cursor.read_scalar<uint8_t>();
+		assert(waves_packtype == 'Z' or waves_packtype == '4' or waves_packtype == 'F');
 		// std::println("waves_count {}, packtype {}", waves_count, waves_packtype);
 
 
-		file.seekg(block.data_end() - 24);
-		auto time_uncompressed_length = read_scalar<uint64_t>();
-		auto time_compressed_length = read_scalar<uint64_t>();
-		auto time_count = read_scalar<uint64_t>();
+		cursor.seek(block.data_end() - 24);
+		auto time_uncompressed_length = cursor.read_scalar<uint64_t>();
+		auto time_compressed_length = cursor.read_scalar<uint64_t>();
+		auto time_count = cursor.read_scalar<uint64_t>();
 
 		auto time_data_pos = block.data_end() - 24 - time_compressed_length;
 
@@ -56,11 +149,9 @@ struct FstMetadataReader
 		// std::println("time_uncompressed_length {}, time_compressed_length {}, time_count {}",
 		// time_uncompressed_length, time_compressed_length, time_count);
 
-		// std::println("time_data {}", time_deltas);
+		cursor.seek(time_data_pos - 8);
 
-		file.seekg(time_data_pos - 8);
-
-		auto position_length = read_scalar<uint64_t>();
+		auto position_length = cursor.read_scalar<uint64_t>();
 
 		// std::println("position_length {}", position_length);
 
@@ -69,19 +160,52 @@ struct FstMetadataReader
 
 		auto wave_data_len = position_data_pos - wave_data_pos;
 		// std::println("wave data len: {}", wave_data_len);
-		file.seekg(position_data_pos);
 
-		std::vector<int64_t> positions(metadata.num_ids);
-		std::vector<uint32_t> lengths(metadata.num_ids);
+		// the header of a file that is still being written doesn't know the number of vars yet, the
+		// block knows its own max handle though
+		auto num_ids = std::max<uint64_t>(metadata.num_ids, waves_count);
+		std::vector<int64_t> positions(num_ids);
+		std::vector<uint32_t> lengths(num_ids);
+
+		// the table is followed by the 8 byte position_length, so the bulk decoder can always load
+		// 8 bytes
+		const byte_t* table = data + position_data_pos;
+		const byte_t* table_end = data + time_data_pos - 8;
 
 		auto var_idx = 0;
 		int64_t bytes_offset = 0;
 		auto previous_alias = 0;
 		auto previous_actual_var = 0;
 
-		do {
-			if (file.peek() & 0b1) {
-				auto v = read_svarint();
+		auto add_position = [&](int64_t delta) {
+			bytes_offset += delta;
+			positions[var_idx] = bytes_offset + wave_data_pos;
+			if (bytes_offset != delta) {
+				lengths[previous_actual_var] = delta;
+			}
+			previous_actual_var = var_idx;
+		};
+
+		while (block.ty != FstBlockType::VCDataDynAlias2 and table < table_end) {
+			// 0 is followed by the 1 based index of the var this one aliases, odd values are
+			// position deltas and even values zero runs
+			int bits;
+			auto v = read_varint_bulk(table, bits);
+			if (v == 0) {
+				auto alias = read_varint_bulk(table, bits);
+				positions[var_idx] = -int64_t(alias);
+				var_idx += 1;
+			} else if (v & 1) {
+				add_position(v >> 1);
+				var_idx += 1;
+			} else {
+				var_idx += v >> 1;
+			}
+		}
+
+		while (block.ty == FstBlockType::VCDataDynAlias2 and table < table_end) {
+			if (*table & 0b1) {
+				auto v = read_svarint_bulk(table);
 				// std::println("read sint {}", v);
 				int64_t decoded = v >> 1;
 				if (decoded == 0) {
@@ -92,29 +216,25 @@ struct FstMetadataReader
 					positions[var_idx] = previous_alias;
 					// std::println("var_idx {} is alias of {}", var_idx, -(previous_alias + 1));
 				} else {
-					bytes_offset += decoded;
-					positions[var_idx] = bytes_offset + wave_data_pos;
-					if (bytes_offset != decoded) {
-						lengths[previous_actual_var] = decoded;
-					}
-					previous_actual_var = var_idx;
+					add_position(decoded);
 					// std::println("var_idx {} has data at offset {}", var_idx, bytes_offset);
 				}
 				var_idx += 1;
 			} else {
-				auto v = read_varint();
+				int bits;
+				auto v = read_varint_bulk(table, bits);
 				// std::println("read varint {}", v);
 				auto run_length = v >> 1;
 				// std::println("zero run of len {}, var_idx {}", run_length, var_idx);
 				var_idx += run_length;
 			}
-		} while (static_cast<uint64_t>(file.tellg()) < time_data_pos - 8);
+		}
 
 		if (bytes_offset > 0) {
 			lengths[previous_actual_var] = wave_data_len - bytes_offset;
 		}
 
-		for (uint64_t i = 0; i < metadata.num_ids; i++) {
+		for (uint64_t i = 0; i < num_ids; i++) {
 			auto pos = positions[i];
 			if (pos < 0) {
 				positions[i] = positions[-(pos + 1)];
@@ -122,7 +242,7 @@ struct FstMetadataReader
 			}
 		}
 
-		for (uint64_t i = 0; i < metadata.num_ids; i++) {
+		for (uint64_t i = 0; i < num_ids; i++) {
 			if (positions[i] > 0) {
 				assert(lengths[i] > 0);
 			}
@@ -130,7 +250,6 @@ struct FstMetadataReader
 
 		// std::println("lengths {}", lengths);
 		// std::println("positions {}", positions);
-		// auto position_length = read_scalar<uint64_t>();
 		FstVCBlockInfo ret = {
 		    .wave_data_offset = positions,
 		    .wave_data_compressed_length = lengths,
@@ -141,25 +260,25 @@ struct FstMetadataReader
 		    .bits_uncompressed_length = bits_uncompressed_length,
 		    .bits_compressed_length = bits_compressed_length,
 		    .bits_count = bits_count,
+		    .bits_data_pos = bits_data_pos,
 
 		    .time_uncompressed_length = time_uncompressed_length,
 		    .time_compressed_length = time_compressed_length,
 		    .time_count = time_count,
 		    .time_data_pos = time_data_pos,
-		    .wave_data_pos = static_cast<uint64_t>(wave_data_pos),
+		    .wave_data_pos = wave_data_pos,
+		    .packtype = waves_packtype,
 		};
 		return ret;
 	}
 
-	GeometryT read_geometry(FstBlock block)
+	GeometryT read_geometry(FstBlock block) const
 	{
-		file.seekg(block.data_start());
-		auto uncompressed_length = read_scalar<uint64_t>();
-		auto count = read_scalar<uint64_t>();
+		MmapCursor cursor(data, block.data_start());
+		auto uncompressed_length = cursor.read_scalar<uint64_t>();
+		auto count = cursor.read_scalar<uint64_t>();
 
 		auto compressed_length = block.len - 24;
-		auto buf = new char[compressed_length];
-		file.read(buf, compressed_length);
 		GeometryT geometry(count);
 		with_maybe_uncompress(
 		    [&](const byte_t* data, uint64_t) {
@@ -167,87 +286,60 @@ struct FstMetadataReader
 				    geometry[i] = ::read_varint(data);
 			    }
 		    },
-		    (const byte_t *) buf, compressed_length, uncompressed_length);
-
-		delete[] buf;
+		    cursor.pos, compressed_length, uncompressed_length);
 
 		return geometry;
 	}
 
-	int64_t read_svarint()
-	{
-		int64_t result = 0;
-		unsigned char data;
-
-		int i = 0;
-		do {
-			file.read((char*) &data, 1);
-			result |= ((int64_t) (data & 0b0111'1111)) << (7 * i++);
-		} while (data & 0b1000'0000);
-		if ((7 * i < 64) and (data & 0b0100'0000)) {
-			result |= -(1LL << (7 * i));
-		}
-		return result;
-	}
-
-	uint64_t read_varint()
-	{
-		uint64_t result = 0;
-		unsigned char data;
-
-		int i = 0;
-		do {
-			file.read((char*) &data, 1);
-			result |= ((uint64_t) (data & 0b0111'1111)) << (7 * i++);
-		} while (data & 0b1000'0000);
-		return result;
-	}
-
-	FstHeader read_header(FstBlock block)
+	FstHeader read_header(FstBlock block) const
 	{
 		FstHeader header;
-		file.seekg(block.data_start());
-		header.start_time = read_scalar<uint64_t>();
-		header.end_time = read_scalar<uint64_t>();
+		MmapCursor cursor(data, block.data_start());
+		header.start_time = cursor.read_scalar<uint64_t>();
+		header.end_time = cursor.read_scalar<uint64_t>();
 		[[maybe_unused]]
-		auto real_endianess = read_scalar<double>();
+		auto real_endianess = cursor.read_scalar<double>();
 		// std::println("endianess: {}", real_endianess);
 		[[maybe_unused]]
-		auto writer_memory_use = read_scalar<uint64_t>();
+		auto writer_memory_use = cursor.read_scalar<uint64_t>();
 		[[maybe_unused]]
-		auto num_scopes = read_scalar<uint64_t>();
+		auto num_scopes = cursor.read_scalar<uint64_t>();
 		[[maybe_unused]]
-		auto num_hierarchy_vars = read_scalar<uint64_t>();
+		auto num_hierarchy_vars = cursor.read_scalar<uint64_t>();
 		// std::println("hierarchy vars: {}", num_hierarchy_vars);
-		header.num_vars = read_scalar<uint64_t>();
+		header.num_vars = cursor.read_scalar<uint64_t>();
 		// std::println("vars: {}", header.num_vars);
 		[[maybe_unused]]
-		auto num_vc_blocs = read_scalar<uint64_t>();
+		auto num_vc_blocs = cursor.read_scalar<uint64_t>();
 		[[maybe_unused]]
-		auto timescale = read_scalar<int8_t>();
-		char writer[129];
-		file.read(writer, 128);
-		writer[128] = '\0';
-		// std::println("writer: `{}`", writer);
-		char date[26];
-		file.read(date, sizeof(date));
-		char dummy[3];
-		file.read(dummy, sizeof(dummy));
+		auto timescale = cursor.read_scalar<int8_t>();
+		// writer (128), date (26) and 3 bytes of padding
+		cursor.skip(128 + 26 + 3);
 		[[maybe_unused]]
-		auto filetype = read_scalar<uint8_t>();
+		auto filetype = cursor.read_scalar<uint8_t>();
 		// std::println("filetype {}", filetype);
 		[[maybe_unused]]
-		auto timezero = read_scalar<int64_t>();
+		auto timezero = cursor.read_scalar<int64_t>();
 		// std::println("timezero {}", timezero);
 		return header;
 	}
 
 	void read_blocks()
 	{
-		file.seekg(0, file.beg);
-		while (true) {
-			auto block = read_block();
+		using clock = std::chrono::steady_clock;
+		auto start = clock::now();
+
+		std::vector<FstBlock> vc_blocks;
+		MmapCursor cursor(data, metadata.scanned_until);
+		while (cursor.tell() + 9 <= size) {
+			FstBlockType type = static_cast<FstBlockType>(cursor.read_scalar<uint8_t>());
+			uint64_t len = cursor.read_scalar<uint64_t>();
+			FstBlock block{type, len, cursor.tell()};
 			// std::println("found block {}", block);
+			// a block that is still being written
+			if (len < 8 or block.data_end() > size) {
+				break;
+			}
 
 			if (block.ty == FstBlockType::Header) {
 				auto header = read_header(block);
@@ -258,51 +350,161 @@ struct FstMetadataReader
 
 			if (block.ty == FstBlockType::Geometry) {
 				metadata.nbits = read_geometry(block);
-				metadata.nbits_prefix_sum = GeometrySumT(metadata.nbits.size());
-				std::partial_sum(
-				    metadata.nbits.begin(), metadata.nbits.end(),
-				    metadata.nbits_prefix_sum.begin());
+				metadata.frame_offsets = GeometrySumT(metadata.nbits.size());
+				std::transform_exclusive_scan(
+				    metadata.nbits.begin(), metadata.nbits.end(), metadata.frame_offsets.begin(),
+				    uint32_t{0}, std::plus{}, [](uint32_t nbits) { return nbits ? nbits : 8; });
 				// std::println("metadata.nbits {}", metadata.nbits);
 			}
 
-			if (block.ty == FstBlockType::VCDataDynAlias2) {
-				metadata.vcblocks.push_back(read_dyn_alias2(block));
+			if (block.ty == FstBlockType::Hierarchy or block.ty == FstBlockType::HierarchyLZ4 or
+			    block.ty == FstBlockType::HierarchyLZ4Duo) {
+				metadata.hierarchy = block;
 			}
 
-			file.seekg(block.data_end());
+			if (block.ty == FstBlockType::VCData or block.ty == FstBlockType::VCDataDynAlias or
+			    block.ty == FstBlockType::VCDataDynAlias2) {
+				vc_blocks.push_back(block);
+			}
 
-			if (file.peek() == EOF)
-				break;
+			cursor.seek(block.data_end());
+			// the writer only turns a skip block into a real one once it is complete, so parsing
+			// continues at a trailing skip block when the metadata is extended
+			if (block.ty != FstBlockType::Skip) {
+				metadata.scanned_until = cursor.tell();
+			}
 		}
-	}
+		auto located = clock::now();
 
-	FstBlock read_block()
-	{
-		FstBlockType type = static_cast<FstBlockType>(read_scalar<uint8_t>());
-		uint64_t len = read_scalar<uint64_t>();
-		return {type, len, static_cast<uint64_t>(file.tellg())};
-	}
+		// the position tables need num_ids, so they can only be decoded once the header was seen
+		auto known = metadata.vcblocks.size();
+		metadata.vcblocks.resize(known + vc_blocks.size());
+		parallel_for(vc_blocks.size(), threads, [&](size_t i) {
+			metadata.vcblocks[known + i] =
+			    std::make_shared<const FstVCBlockInfo>(read_vc_block(vc_blocks[i]));
+		});
+		auto decoded = clock::now();
 
-	template <typename T>
-	T read_scalar()
-	{
-		T value{0};
-		file.read(reinterpret_cast<char*>(&value), sizeof(T));
-		if (file.gcount() != sizeof(T)) {
-			assert(false);
+		// the header of a file that is still being written has no end time yet
+		if (not metadata.vcblocks.empty()) {
+			metadata.end_time = std::max(metadata.end_time, metadata.vcblocks.back()->end_time);
 		}
-		if constexpr (std::is_same<T, float>() or std::is_same<T, double>()) {
-			return value;
-		} else {
-			return std::byteswap(value);
+
+		if (known > 0 and vc_blocks.empty()) {
+			return;
 		}
+		using ms = std::chrono::duration<double, std::milli>;
+		std::println(
+		    "fst metadata: located {} vc blocks in {:.1f}ms, decoded their position tables in "
+		    "{:.1f}ms on {} threads",
+		    vc_blocks.size(), ms(located - start).count(), ms(decoded - located).count(),
+		    std::min(threads, std::max<size_t>(vc_blocks.size(), 1)));
 	}
 };
 
-FstMetaData init_metadata(const char* path)
+FstMetaData init_metadata(const byte_t* data, uint64_t size, size_t threads)
 {
-	FstMetadataReader reader(path);
-	return reader.metadata;
+	return extend_metadata(data, size, threads, {});
+}
+
+FstMetaData extend_metadata(const byte_t* data, uint64_t size, size_t threads, FstMetaData metadata)
+{
+	FstMetadataReader reader(data, size, threads, std::move(metadata));
+	return std::move(reader.metadata);
+}
+
+FstMetaData concat_metadata(std::vector<FstMetaData> segments)
+{
+	auto metadata = std::move(segments.front());
+	for (size_t s = 1; s < segments.size(); s++) {
+		auto& segment = segments[s];
+		if (segment.num_ids != metadata.num_ids or segment.nbits != metadata.nbits) {
+			throw std::runtime_error(
+			    std::format("file {} of the trace has different signals than the first", s));
+		}
+		uint64_t offset =
+		    segment.start_time < metadata.end_time ? metadata.end_time + 1 - segment.start_time : 0;
+		// the time tables and the offset in every block are 32 bit
+		if (segment.end_time + offset > UINT32_MAX) {
+			throw std::runtime_error(std::format(
+			    "file {} of the trace ends at time {}, past the 32 bit times the reader supports",
+			    s, segment.end_time + offset));
+		}
+		for (const auto& block : segment.vcblocks) {
+			auto moved = std::make_shared<FstVCBlockInfo>(*block);
+			moved->segment = static_cast<uint32_t>(s);
+			moved->time_offset = static_cast<uint32_t>(offset);
+			moved->start_time += offset;
+			moved->end_time += offset;
+			metadata.vcblocks.push_back(std::move(moved));
+		}
+		metadata.end_time = segment.end_time + offset;
+	}
+	return metadata;
+}
+
+std::vector<FstHierRecord> parse_hierarchy(const char* data, uint64_t size)
+{
+	constexpr uint8_t ATTRBEGIN = 252;
+	constexpr uint8_t ATTREND = 253;
+	constexpr uint8_t SCOPE = 254;
+	constexpr uint8_t UPSCOPE = 255;
+	// ports store 3 * length + 2
+	constexpr uint8_t VAR_TYPE_PORT = 18;
+
+	std::vector<FstHierRecord> records;
+	auto pos = reinterpret_cast<const byte_t*>(data);
+	auto end = pos + size;
+	uint32_t max_handle = 0;
+
+	auto read_string = [&] {
+		auto str = reinterpret_cast<const char*>(pos);
+		auto len = std::strlen(str);
+		pos += len + 1;
+		return std::string_view(str, len);
+	};
+
+	while (pos < end) {
+		FstHierRecord record{};
+		auto tag = *pos++;
+		switch (tag) {
+			case ATTRBEGIN:
+				record.kind = FstHierKind::AttrBegin;
+				record.typ = *pos++;
+				record.subtype = *pos++;
+				record.name = read_string();
+				record.length = read_varint(pos);
+				break;
+			case ATTREND:
+				record.kind = FstHierKind::AttrEnd;
+				break;
+			case SCOPE:
+				record.kind = FstHierKind::Scope;
+				record.typ = *pos++;
+				record.name = read_string();
+				record.component = read_string();
+				break;
+			case UPSCOPE:
+				record.kind = FstHierKind::Upscope;
+				break;
+			default: {
+				record.kind = FstHierKind::Var;
+				record.typ = tag;
+				record.subtype = *pos++;
+				record.name = read_string();
+				record.length = read_varint(pos);
+				if (record.typ == VAR_TYPE_PORT) {
+					record.length = (record.length - 2) / 3;
+				}
+				// 0 means this var has its own handle
+				auto alias = read_varint(pos);
+				record.handle = alias ? alias : ++max_handle;
+				break;
+			}
+		}
+		records.push_back(record);
+	}
+	return records;
 }
 
 }
@@ -312,7 +514,7 @@ std::vector<uint32_t> FstVCBlockInfo::read_time_table(const byte_t* data) const
 	std::vector<uint32_t> time(time_count);
 	with_maybe_uncompress(
 	    [&](const byte_t* data, auto) {
-			masked_vbyte_decode_delta(data, time.data(), time_count, 0);
+			masked_vbyte_decode_delta(data, time.data(), time_count, time_offset);
 		    // auto last = 0;
 		    // for (uint64_t i = 0; i < time_count; i++) {
 			//     auto v = read_varint(data);
@@ -324,7 +526,505 @@ std::vector<uint32_t> FstVCBlockInfo::read_time_table(const byte_t* data) const
 	return time;
 }
 
-const byte_t* FstReader::file_mmap() const
+std::string FstVCBlockInfo::read_frame(const byte_t* data) const
+{
+	std::string frame(bits_uncompressed_length, '\0');
+	with_maybe_uncompress(
+	    [&](const byte_t* data, auto n) { std::memcpy(frame.data(), data, n); },
+	    data + bits_data_pos, bits_compressed_length, bits_uncompressed_length);
+	return frame;
+}
+
+FstDecodedChanges FstBlockByBlock::decode(uint32_t facid) const
+{
+	FstDecodedChanges changes;
+	const auto& nbits = reader.metadata->nbits;
+	changes.bytes = facid < nbits.size() ? (nbits[facid] + 7) / 8 : 0;
+	changes.binary = read_values(facid, [&](uint32_t time, const byte_t* data, uint16_t bytes) {
+		changes.times.push_back(time);
+		changes.values.insert(changes.values.end(), data, data + bytes);
+	});
+	return changes;
+}
+
+void FstReader::set_parallelism(size_t n)
+{
+	parallelism = std::max<size_t>(n, 1);
+}
+
+std::shared_ptr<const TimeTable> FstReader::time_table(size_t block_idx) const
+{
+	auto cached = time_tables->get(block_idx);
+	if (cached) {
+		return cached;
+	}
+	auto decoded =
+	    std::make_shared<const TimeTable>(metadata->vcblocks[block_idx]->read_time_table(
+	    file_mmap(metadata->vcblocks[block_idx]->segment)));
+	time_tables->add(block_idx, decoded, decoded->size() * sizeof(uint32_t));
+	return decoded;
+}
+
+FstDecodedChanges FstReader::decode_block(size_t block_idx, uint32_t facid) const
+{
+	auto table = time_table(block_idx);
+	return FstBlockByBlock{*table, *metadata->vcblocks[block_idx], *this}.decode(facid);
+}
+
+std::pair<size_t, size_t> FstReader::blocks_in(uint64_t t_begin, uint64_t t_end) const
+{
+	const auto& blocks = metadata->vcblocks;
+	auto first = std::partition_point(blocks.begin(), blocks.end(), [&](const auto& block) {
+		return block->end_time < t_begin;
+	});
+	auto last = std::partition_point(first, blocks.end(), [&](const auto& block) {
+		return block->start_time <= t_end;
+	});
+	return {first - blocks.begin(), last - blocks.begin()};
+}
+
+FstReader::FstReader(
+    const char* path,
+    size_t time_table_cache_bytes,
+    std::shared_ptr<const MvIndex> index,
+    size_t threads) :
+    path(path),
+    mapped_files{std::make_shared<bip::mapped_region>(
+        bip::file_mapping(path, bip::read_only), bip::read_only)},
+    time_tables(std::make_shared<TimeTableCache>(time_table_cache_bytes)),
+    id(next_id++),
+    index(std::move(index))
+{
+	// the index was checked against the file before it was mapped
+	auto indexed = this->index and this->index->fst_size() == mapped_files[0]->get_size()
+	                   ? this->index->metadata()
+	                   : std::nullopt;
+	if (indexed) {
+		metadata = std::make_shared<FstMetaData>(std::move(*indexed));
+	} else {
+		this->index.reset();
+		metadata = std::make_shared<FstMetaData>(impl::init_metadata(
+		    file_mmap(), mapped_files[0]->get_size(), threads));
+	}
+}
+
+FstReader::FstReader(
+    std::span<const std::string> paths, size_t time_table_cache_bytes, size_t threads) :
+    path(paths.front()),
+    mapped_files(paths.size()),
+    time_tables(std::make_shared<TimeTableCache>(time_table_cache_bytes)),
+    id(next_id++)
+{
+	std::vector<FstMetaData> segments(paths.size());
+	auto threads_per_file = std::max<size_t>(threads / paths.size(), 1);
+	impl::parallel_for(paths.size(), threads, [&](size_t i) {
+		mapped_files[i] = std::make_shared<bip::mapped_region>(
+		    bip::file_mapping(paths[i].c_str(), bip::read_only), bip::read_only);
+		segments[i] =
+		    impl::init_metadata(file_mmap(i), mapped_files[i]->get_size(), threads_per_file);
+	});
+	metadata = std::make_shared<FstMetaData>(impl::concat_metadata(std::move(segments)));
+}
+
+size_t FstReader::num_blocks() const
+{
+	return metadata->vcblocks.size();
+}
+
+uint64_t FstReader::compressed_size(uint32_t facid) const
+{
+	uint64_t size = 0;
+	for (const auto& block : metadata->vcblocks) {
+		if (facid < block->wave_data_offset.size() and block->wave_data_offset[facid] > 0) {
+			size += block->wave_data_compressed_length[facid];
+		}
+	}
+	return size;
+}
+
+uint64_t FstReader::start_time() const
+{
+	return metadata->start_time;
+}
+
+uint64_t FstReader::end_time() const
+{
+	return metadata->end_time;
+}
+
+bool FstReader::has_hierarchy() const
+{
+	return (index and not index->hierarchy().empty()) or metadata->hierarchy.has_value();
+}
+
+FstHierarchy FstReader::read_hierarchy() const
+{
+	FstHierarchy hierarchy;
+	if (index and not index->hierarchy().empty()) {
+		auto stored = index->hierarchy();
+		hierarchy.size = stored.size();
+		hierarchy.data.reset(new char[hierarchy.size + 1]);
+		std::memcpy(hierarchy.data.get(), stored.data(), hierarchy.size);
+		hierarchy.data[hierarchy.size] = 0;
+		hierarchy.records = impl::parse_hierarchy(hierarchy.data.get(), hierarchy.size);
+		return hierarchy;
+	}
+	if (not metadata->hierarchy) {
+		return hierarchy;
+	}
+
+	auto block = *metadata->hierarchy;
+	MmapCursor cursor(file_mmap(), block.data_start());
+	auto uncompressed_length = cursor.read_scalar<uint64_t>();
+	auto compressed = file_mmap() + cursor.tell();
+	auto compressed_length = block.data_end() - cursor.tell();
+
+	// the extra zero terminates the last string even in a truncated hierarchy
+	hierarchy.data.reset(new char[uncompressed_length + 1]);
+	hierarchy.data[uncompressed_length] = 0;
+	auto out = hierarchy.data.get();
+
+	if (block.ty == FstBlockType::Hierarchy) {
+		// a gzip stream, not plain zlib
+		z_stream stream{};
+		stream.next_in = const_cast<byte_t*>(compressed);
+		stream.avail_in = compressed_length;
+		stream.next_out = reinterpret_cast<byte_t*>(out);
+		stream.avail_out = uncompressed_length;
+		[[maybe_unused]]
+		auto ret = inflateInit2(&stream, 16 + MAX_WBITS);
+		assert(ret == Z_OK);
+		ret = inflate(&stream, Z_FINISH);
+		assert(ret == Z_STREAM_END);
+		inflateEnd(&stream);
+	} else if (block.ty == FstBlockType::HierarchyLZ4) {
+		[[maybe_unused]]
+		auto ret = LZ4_decompress_safe(
+		    reinterpret_cast<const char*>(compressed), out, compressed_length, uncompressed_length);
+		assert(ret == (int) uncompressed_length);
+	} else {
+		// compressed twice, with the intermediate length in front
+		auto intermediate_length = read_varint(compressed);
+		compressed_length -= compressed - (file_mmap() + cursor.tell());
+		auto intermediate = BufferPool::acquire(intermediate_length);
+		[[maybe_unused]]
+		auto ret = LZ4_decompress_safe(
+		    reinterpret_cast<const char*>(compressed), reinterpret_cast<char*>(intermediate.data()),
+		    compressed_length, intermediate_length);
+		assert(ret == (int) intermediate_length);
+		ret = LZ4_decompress_safe(
+		    reinterpret_cast<const char*>(intermediate.data()), out, intermediate_length,
+		    uncompressed_length);
+		assert(ret == (int) uncompressed_length);
+	}
+
+	hierarchy.size = uncompressed_length;
+	hierarchy.records = impl::parse_hierarchy(out, uncompressed_length);
+	return hierarchy;
+}
+
+void FstReader::save_index(const std::map<uint32_t, MvIndex::Db>& dbs) const
+{
+	if (mapped_files.size() > 1) {
+		return;
+	}
+	auto hierarchy = read_hierarchy();
+	MvIndex::write(
+	    path, mapped_files[0]->get_size(), *metadata, {hierarchy.data.get(), hierarchy.size}, dbs);
+}
+
+size_t FstReader::num_segments() const
+{
+	return mapped_files.size();
+}
+
+std::pair<size_t, uint64_t> FstReader::segment_at(uint64_t time) const
+{
+	auto block_idx = block_at(time);
+	if (not block_idx) {
+		return {0, 0};
+	}
+	const auto& block = *metadata->vcblocks[*block_idx];
+	return {block.segment, block.time_offset};
+}
+
+namespace {
+// (reader id, block index, facid)
+using ChunkKey = std::tuple<uint64_t, size_t, uint32_t>;
+
+struct ChunkKeyHash
+{
+	size_t operator()(const ChunkKey& key) const
+	{
+		auto [reader, block, facid] = key;
+		return std::hash<uint64_t>{}(
+		    (reader * 0x9e37'79b9'7f4a'7c15ULL) ^ (uint64_t(block) << 32) ^ facid);
+	}
+};
+
+// value_at is called for the same handful of vars over and over while rendering
+constexpr size_t CHUNK_CACHE_BYTES = 64 << 20;
+constexpr size_t FRAME_CACHE_BYTES = 64 << 20;
+}
+
+std::shared_ptr<const FstDecodedChanges> FstReader::cached_changes(size_t block_idx, uint32_t facid) const
+{
+	static ShardedCache<ChunkKey, FstDecodedChanges, ChunkKeyHash> chunks(CHUNK_CACHE_BYTES);
+	ChunkKey key{id, block_idx, facid};
+	auto cached = chunks.get(key);
+	if (cached) {
+		return cached;
+	}
+	auto decoded = std::make_shared<const FstDecodedChanges>(decode_block(block_idx, facid));
+	chunks.add(
+	    key, decoded,
+	    sizeof(FstDecodedChanges) + decoded->times.size() * sizeof(uint32_t) +
+	        decoded->values.size());
+	return decoded;
+}
+
+std::shared_ptr<const std::string> FstReader::cached_frame(size_t block_idx) const
+{
+	// not sharded, a single frame can be larger than a shard
+	static BudgetedCache<ChunkKey, std::string, ChunkKeyHash> frames(FRAME_CACHE_BYTES);
+	ChunkKey key{id, block_idx, 0};
+	auto cached = frames.get(key);
+	if (cached) {
+		return cached;
+	}
+	const auto& block = *metadata->vcblocks[block_idx];
+	auto decoded = std::make_shared<const std::string>(block.read_frame(file_mmap(block.segment)));
+	frames.add(key, decoded, decoded->size());
+	return decoded;
+}
+
+bool FstReader::checkpoint(size_t block_idx, uint32_t facid, byte_t* out) const
+{
+	if (facid >= metadata->nbits.size() or metadata->nbits[facid] == 0) {
+		return false;
+	}
+	auto nbits = metadata->nbits[facid];
+	auto frame = cached_frame(block_idx);
+	auto chars = frame->data() + metadata->frame_offsets[facid];
+	// msb first and left aligned, x and z read as 0
+	std::memset(out, 0, (nbits + 7) / 8);
+	for (uint32_t i = 0; i < nbits; i++) {
+		if (chars[i] == '1') {
+			out[i / 8] |= 0b1000'0000 >> (i % 8);
+		}
+	}
+	return true;
+}
+
+std::optional<size_t> FstReader::block_at(uint64_t time) const
+{
+	const auto& blocks = metadata->vcblocks;
+	auto block = std::partition_point(blocks.begin(), blocks.end(), [&](const auto& block) {
+		return block->start_time <= time;
+	});
+	if (block == blocks.begin()) {
+		return std::nullopt;
+	}
+	return block - blocks.begin() - 1;
+}
+
+bool FstReader::value_at(uint32_t facid, uint64_t time, char* out) const
+{
+	if (facid >= metadata->nbits.size() or metadata->nbits[facid] == 0) {
+		return false;
+	}
+	auto block_idx = block_at(time);
+	if (not block_idx) {
+		return false;
+	}
+	return write_value(*block_idx, facid, time, out);
+}
+
+FstSnapshot FstReader::snapshot(uint64_t time, std::span<const uint32_t> facids) const
+{
+	FstSnapshot snapshot;
+	snapshot.offsets.assign(facids.size(), FstSnapshot::NO_VALUE);
+	auto block_idx = block_at(time);
+	if (not block_idx) {
+		return snapshot;
+	}
+
+	size_t size = 0;
+	for (size_t i = 0; i < facids.size(); i++) {
+		auto facid = facids[i];
+		if (facid < metadata->nbits.size() and metadata->nbits[facid] > 0) {
+			snapshot.offsets[i] = size;
+			size += metadata->nbits[facid] + 1;
+		}
+	}
+	snapshot.chars.assign(size, '\0');
+
+	for (size_t i = 0; i < facids.size(); i++) {
+		if (snapshot.offsets[i] != FstSnapshot::NO_VALUE and
+		    not write_value(
+		        *block_idx, facids[i], time, snapshot.chars.data() + snapshot.offsets[i])) {
+			snapshot.offsets[i] = FstSnapshot::NO_VALUE;
+		}
+	}
+	return snapshot;
+}
+
+bool FstReader::write_value(size_t block_idx, uint32_t facid, uint64_t time, char* out) const
+{
+	auto nbits = metadata->nbits[facid];
+	auto changes = cached_changes(block_idx, facid);
+	auto change = std::upper_bound(changes->times.begin(), changes->times.end(), time);
+	if (change != changes->times.begin()) {
+		// the change might have been x or z, which only the frames keep
+		if (not changes->binary) {
+			return false;
+		}
+		// packed msb first, single bits have the same format
+		auto value = changes->values.data() + (change - changes->times.begin() - 1) * changes->bytes;
+		for (uint32_t i = 0; i < nbits; i++) {
+			out[i] = (value[i / 8] >> (7 - i % 8)) & 0b1 ? '1' : '0';
+		}
+	} else {
+		// no change in this block up to time, so the value from the start of the block
+		auto frame = cached_frame(block_idx);
+		std::memcpy(out, frame->data() + metadata->frame_offsets[facid], nbits);
+	}
+	out[nbits] = '\0';
+	return true;
+}
+
+std::optional<size_t> FstCursor::watch(uint32_t facid)
+{
+	if (facid >= reader.metadata->nbits.size() or reader.metadata->nbits[facid] == 0) {
+		return std::nullopt;
+	}
+	auto [it, inserted] = slots.try_emplace(facid, facids.size());
+	auto slot = it->second;
+	if (not inserted) {
+		last_watched[slot] = loads;
+		return slot;
+	}
+
+	facids.push_back(facid);
+	offsets.push_back(chars.size());
+	last_watched.push_back(loads);
+	exact.push_back(true);
+	chars.resize(chars.size() + reader.metadata->nbits[facid] + 1, '\0');
+	if (not block) {
+		return slot;
+	}
+	// catch up to the current time, the later changes are merged into the pending events
+	const auto& decoded = reset(slot);
+	auto pending = events.size();
+	for (size_t i = 0; i < decoded.times.size(); i++) {
+		Event event{
+		    decoded.times[i], uint32_t(slot), decoded.values.data() + i * decoded.bytes,
+		    decoded.binary};
+		if (event.time <= time) {
+			apply(event);
+		} else {
+			events.push_back(event);
+		}
+	}
+	std::inplace_merge(
+	    events.begin() + next_event, events.begin() + pending, events.end(),
+	    [](const auto& a, const auto& b) { return a.time < b.time; });
+	return slot;
+}
+
+void FstCursor::seek(uint64_t new_time)
+{
+	auto block_idx = reader.block_at(new_time);
+	if (block_idx != block or new_time < time) {
+		load(block_idx);
+	}
+	time = new_time;
+	while (next_event < events.size() and events[next_event].time <= time) {
+		apply(events[next_event++]);
+	}
+}
+
+const char* FstCursor::value(size_t slot) const
+{
+	return block and exact[slot] ? chars.data() + offsets[slot] : nullptr;
+}
+
+void FstCursor::load(std::optional<size_t> block_idx)
+{
+	block = block_idx;
+	loads++;
+	drop_idle();
+	changes.clear();
+	events.clear();
+	next_event = 0;
+	if (not block) {
+		return;
+	}
+
+	for (uint32_t slot = 0; slot < facids.size(); slot++) {
+		const auto& decoded = reset(slot);
+		for (size_t i = 0; i < decoded.times.size(); i++) {
+			events.push_back(
+			    {decoded.times[i], slot, decoded.values.data() + i * decoded.bytes, decoded.binary});
+		}
+	}
+	std::stable_sort(events.begin(), events.end(), [](const auto& a, const auto& b) {
+		return a.time < b.time;
+	});
+}
+
+void FstCursor::drop_idle()
+{
+	auto idle = [&](size_t slot) { return loads - last_watched[slot] > MAX_IDLE_LOADS; };
+	size_t kept = 0;
+	for (size_t slot = 0; slot < facids.size(); slot++) {
+		if (idle(slot)) {
+			slots.erase(facids[slot]);
+		} else {
+			facids[kept] = facids[slot];
+			last_watched[kept] = last_watched[slot];
+			slots[facids[kept]] = kept;
+			kept++;
+		}
+	}
+	if (kept == facids.size()) {
+		return;
+	}
+	facids.resize(kept);
+	last_watched.resize(kept);
+	exact.resize(kept);
+	// every slot is reset by the load anyway
+	offsets.clear();
+	size_t size = 0;
+	for (auto facid : facids) {
+		offsets.push_back(size);
+		size += reader.metadata->nbits[facid] + 1;
+	}
+	chars.assign(size, '\0');
+}
+
+const FstDecodedChanges& FstCursor::reset(size_t slot)
+{
+	auto facid = facids[slot];
+	auto frame = reader.cached_frame(*block);
+	std::memcpy(
+	    chars.data() + offsets[slot], frame->data() + reader.metadata->frame_offsets[facid],
+	    reader.metadata->nbits[facid]);
+	exact[slot] = true;
+	return *changes.emplace_back(reader.cached_changes(*block, facid));
+}
+
+void FstCursor::apply(const Event& event)
+{
+	auto nbits = reader.metadata->nbits[facids[event.slot]];
+	auto out = chars.data() + offsets[event.slot];
+	for (uint32_t i = 0; i < nbits; i++) {
+		out[i] = (event.value[i / 8] >> (7 - i % 8)) & 0b1 ? '1' : '0';
+	}
+	exact[event.slot] = event.binary;
+}
+
+const byte_t* FstReader::file_mmap(size_t segment) const
 {
-	return static_cast<const byte_t*>(mapped_file->get_address());
+	return static_cast<const byte_t*>(mapped_files[segment]->get_address());
 }
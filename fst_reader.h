@@ -2,9 +2,20 @@
 
 #include <format>
 #include <memory>
+#include <atomic>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 //
+#include "buffer_pool.h"
+#include "lru_cache.h"
+#include "mv_index.h"
+#include "parallel.h"
+
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 
@@ -26,8 +37,9 @@ enum class FstBlockType : uint8_t
 	HierarchyLZ4,
 	HierarchyLZ4Duo,
 	VCDataDynAlias2,
-	ZWrapper,
-	Skip,
+	ZWrapper = 254,
+	// also used by the writer as placeholder for a block that is still being written
+	Skip = 255,
 };
 
 template <>
@@ -154,18 +166,31 @@ struct FstVCBlockInfo
 	uint64_t start_time;
 	uint64_t end_time;
 
+	// the frame holds the value of every var at the start of the block
 	uint64_t bits_uncompressed_length;
 	uint64_t bits_compressed_length;
 	uint64_t bits_count;
+	uint64_t bits_data_pos;
 
 	uint64_t time_uncompressed_length;
 	uint64_t time_compressed_length;
 	uint64_t time_count;
 	uint64_t time_data_pos;
 	uint64_t wave_data_pos;
+	// compression of the per signal wave data, 'Z' zlib, '4' LZ4 or 'F' FastLZ. The frame and the
+	// time table are always zlib.
+	uint8_t packtype;
+
+	// the file of a time split trace the block is in, the positions above are relative to it
+	uint32_t segment = 0;
+	// added to the times in the time table, start_time and end_time already include it
+	uint32_t time_offset = 0;
 
 
 	std::vector<uint32_t> read_time_table(const byte_t* data) const;
+
+	// one char per bit ('0', '1', 'x', ...), reals take 8 raw bytes
+	std::string read_frame(const byte_t* data) const;
 };
 
 struct FstMetaData
@@ -176,46 +201,241 @@ struct FstMetaData
 
 	// 65565 bits should be enough for anybody tm
 	GeometryT nbits;
-	GeometrySumT nbits_prefix_sum;
+	// offset of every var in the frame. Reals have a length of 0 in the geometry, but take 8 bytes
+	GeometrySumT frame_offsets;
 
-	std::vector<FstVCBlockInfo> vcblocks;
+	// Hierarchy, HierarchyLZ4 or HierarchyLZ4Duo
+	std::optional<FstBlock> hierarchy;
+
+	// shared, so extending the metadata of a file that is still being written is cheap
+	std::vector<std::shared_ptr<const FstVCBlockInfo>> vcblocks;
+
+	// the file is parsed up to here, parsing of appended blocks resumes at this offset
+	uint64_t scanned_until = 0;
+};
+
+enum class FstHierKind : uint8_t
+{
+	Var,
+	Scope,
+	Upscope,
+	AttrBegin,
+	AttrEnd,
+};
+
+// one record of the hierarchy, the strings point into the decompressed hierarchy and are null
+// terminated
+struct FstHierRecord
+{
+	FstHierKind kind;
+	// scope type, var type or attr type
+	uint8_t typ;
+	// var direction or attr subtype
+	uint8_t subtype;
+	std::string_view name;
+	// scopes only
+	std::string_view component;
+	// var length in bits or attr argument
+	uint64_t length;
+	// vars only, 1 based like the libfst handles
+	uint32_t handle;
+};
+
+struct FstHierarchy
+{
+	std::unique_ptr<char[]> data;
+	// of data, without the terminating zero
+	uint64_t size = 0;
+	std::vector<FstHierRecord> records;
 };
 
 namespace impl {
-FstMetaData init_metadata(const char* path);
+FstMetaData init_metadata(const byte_t* data, uint64_t size, size_t threads);
+
+// joins the metadata of the files of a time split trace, given in time order. A file whose times
+// start before the end of the previous one is taken to count from zero again and is shifted to
+// right after it. All files need the same signals.
+FstMetaData concat_metadata(std::vector<FstMetaData> segments);
+
+std::vector<FstHierRecord> parse_hierarchy(const char* data, uint64_t size);
+
+// parses the blocks from metadata.scanned_until on and adds them to metadata
+FstMetaData extend_metadata(const byte_t* data, uint64_t size, size_t threads, FstMetaData metadata);
 }
 
+// the changes of one signal in one block, decoded off-thread so they can be replayed in order
+struct FstDecodedChanges
+{
+	uint16_t bytes = 0;
+	std::vector<uint32_t> times;
+	std::vector<byte_t> values;
+	// false if some change was x, z or another non binary value, which are stored as 0 bits
+	bool binary = true;
+
+	template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
+	void replay(F&& f) const
+	{
+		for (size_t i = 0; i < times.size(); i++) {
+			f(times[i], values.data() + i * bytes, bytes);
+		}
+	}
+};
+
+// the values of several vars at one time, packed into one buffer. Every value is nbits '0'/'1'
+// chars plus a terminating zero.
+struct FstSnapshot
+{
+	static constexpr size_t NO_VALUE = SIZE_MAX;
+
+	std::string chars;
+	// offset into chars per requested var, NO_VALUE for reals, times before the first block and
+	// x or z changes, which only libfst can read
+	std::vector<size_t> offsets;
+
+	const char* value(size_t i) const
+	{
+		return offsets[i] == NO_VALUE ? nullptr : chars.data() + offsets[i];
+	}
+};
+
+using TimeTable = std::vector<uint32_t>;
+using TimeTableCache = BudgetedCache<size_t, TimeTable>;
+
 // NOTE(robin): this assumes you will always write the files on a little endian system and therefore
 // will only ever read the floats as little endian
 class FstReader
 {
 	std::string path;
 	// std::shared_ptr<bip::file_mapping> mapping;
-	std::shared_ptr<bip::mapped_region> mapped_file;
+	// one per file of a time split trace, the hierarchy is taken from the first one
+	std::vector<std::shared_ptr<bip::mapped_region>> mapped_files;
 
 	std::shared_ptr<FstMetaData> metadata;
 
-public:
-	FstReader(const char* path) :
-	    path(path),
-	    mapped_file(std::make_shared<bip::mapped_region>(
-	        bip::file_mapping(path, bip::read_only), bip::read_only)),
-	    metadata(std::make_shared<FstMetaData>(impl::init_metadata(path)))
-	{
-	}
+	// decoded time tables by block index, shared by all copies of this reader
+	std::shared_ptr<TimeTableCache> time_tables;
+
+	// number of blocks decoded concurrently, 1 disables the parallel paths
+	size_t parallelism = impl::default_parallelism();
 
-	// TODO(robin): parallel version?
+	// identifies the file in the process wide caches, shared by all copies of this reader
+	uint64_t id;
+
+	// the sidecar index the metadata and hierarchy were loaded from, if any
+	std::shared_ptr<const MvIndex> index;
+
+public:
+	static constexpr size_t DEFAULT_TIME_TABLE_CACHE_BYTES = 256 << 20;
+
+	// the metadata is parsed on up to `threads` threads
+	FstReader(
+	    const char* path,
+	    size_t time_table_cache_bytes = DEFAULT_TIME_TABLE_CACHE_BYTES,
+	    std::shared_ptr<const MvIndex> index = nullptr,
+	    size_t threads = impl::default_parallelism());
+
+	// the files of a time split trace in time order, read as one continuous trace without merging
+	// them. The files are parsed in parallel. The sidecar index is only supported for single
+	// files.
+	FstReader(
+	    std::span<const std::string> paths,
+	    size_t time_table_cache_bytes = DEFAULT_TIME_TABLE_CACHE_BYTES,
+	    size_t threads = impl::default_parallelism());
+
+	// visits the blocks with index in [first_block, last_block)
 	template <std::invocable<const struct FstBlockByBlock&> F>
-	void block_by_block(F&& f) const;
+	void block_by_block(F&& f, size_t first_block = 0, size_t last_block = SIZE_MAX) const;
+
+	// decodes blocks on up to `parallelism` threads, `consume` gets the results of `decode` in time
+	// order on the calling thread. The result of `decode` must not reference the FstBlockByBlock.
+	template <std::invocable<const struct FstBlockByBlock&> D, class F>
+	void block_by_block_parallel(
+	    D&& decode, F&& consume, size_t first_block = 0, size_t last_block = SIZE_MAX) const;
+
+	// the half open range of block indices overlapping [t_begin, t_end]
+	std::pair<size_t, size_t> blocks_in(uint64_t t_begin, uint64_t t_end) const;
 
 	template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
 	void read_values(uint32_t facid, F&& f) const;
 
+	// reads several signals in one pass over the blocks, so every time table is decoded only once.
+	// f gets (facid, time, data, bytes); changes are only time ordered per facid.
+	template <std::invocable<uint32_t, uint32_t, const byte_t*, uint16_t> F>
+	void read_values(std::span<const uint32_t> facids, F&& f, size_t first_block = 0) const;
+
+	// only decodes the blocks overlapping [t_begin, t_end]. The value live at t_begin is reported at
+	// t_begin (if there is one), so the result can be filled forward without looking further back.
+	template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
+	void read_values(uint32_t facid, uint64_t t_begin, uint64_t t_end, F&& f) const;
+
+	void set_parallelism(size_t n);
+
+	size_t num_blocks() const;
+
+	// unique per opened file in this process, copies of a reader share it
+	uint64_t file_id() const
+	{
+		return id;
+	}
+
+	// the compressed bytes of facid over all blocks, a cheap estimate of the cost of reading it
+	uint64_t compressed_size(uint32_t facid) const;
+
+	uint64_t start_time() const;
+
+	uint64_t end_time() const;
+
+	// decompresses and parses the hierarchy in one go, empty if the file has none (yet)
+	FstHierarchy read_hierarchy() const;
+
+	// libfst writes the geometry and hierarchy on close, a live file has neither before
+	bool has_hierarchy() const;
+
+	// writes the sidecar index with the metadata, the hierarchy and the given wave databases
+	void save_index(const std::map<uint32_t, MvIndex::Db>& dbs) const;
+
+	size_t num_segments() const;
+
+	// the file of a time split trace that holds time and the offset of its times, for looking time
+	// up in the file itself. The first file before the first block.
+	std::pair<size_t, uint64_t> segment_at(uint64_t time) const;
+
+	// writes the value of facid at `time` as nbits '0'/'1' chars plus a terminating zero to out.
+	// Returns false for reals and times before the first block.
+	bool value_at(uint32_t facid, uint64_t time, char* out) const;
+
+	// the values of all facids at `time`. Starts from the frame of the block containing time and
+	// applies the changes up to time, so every chunk and the frame are decoded at most once.
+	FstSnapshot snapshot(uint64_t time, std::span<const uint32_t> facids) const;
+
 private:
-	const byte_t* file_mmap() const;
+	const byte_t* file_mmap(size_t segment = 0) const;
+
+	// returns the decoded time table of the given block, from the cache if possible
+	std::shared_ptr<const TimeTable> time_table(size_t block_idx) const;
+
+	FstDecodedChanges decode_block(size_t block_idx, uint32_t facid) const;
+
+	// the changes of facid in a block, from the cache shared by all threads if possible
+	std::shared_ptr<const FstDecodedChanges> cached_changes(size_t block_idx, uint32_t facid) const;
+	// the frame of a block, which is a checkpoint of every value at the start of the block
+	std::shared_ptr<const std::string> cached_frame(size_t block_idx) const;
 
+	// writes the value of facid at the start of the block to out, packed like the changes. Returns
+	// false for reals.
+	bool checkpoint(size_t block_idx, uint32_t facid, byte_t* out) const;
+
+	// the index of the block containing time, nullopt before the first block
+	std::optional<size_t> block_at(uint64_t time) const;
+
+	// writes the value of a non real facid at time, which has to lie in the given block. Returns
+	// false if the value is a change the native decoder could not keep, like x or z.
+	bool write_value(size_t block_idx, uint32_t facid, uint64_t time, char* out) const;
+
+	static inline std::atomic<uint64_t> next_id = 0;
 
 	friend struct FstBlockByBlock;
+	friend class FstCursor;
 };
 
 class FstBlockByBlock
@@ -235,8 +455,76 @@ public:
 	template <typename T>
 	std::pair<std::vector<uint32_t>, std::vector<T>> read_values(uint32_t facid) const;
 
+	// x, z and the other non binary values are passed as 0 bits. Returns false if there were any.
 	template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
-	void read_values(uint32_t facid, F&& f) const;
+	bool read_values(uint32_t facid, F&& f) const;
+
+	template <std::invocable<uint32_t, uint32_t, const byte_t*, uint16_t> F>
+	void read_values(std::span<const uint32_t> facids, F&& f) const;
+
+	// only the changes of this block that lie in [t_begin, t_end]
+	template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
+	void read_values(uint32_t facid, uint64_t t_begin, uint64_t t_end, F&& f) const;
+
+	FstDecodedChanges decode(uint32_t facid) const;
+};
+
+// keeps the current values of a set of watched vars. Moving forward inside a VC block only applies
+// the changes in between, using a time sorted list of the changes of all watched vars in the block.
+// Other moves reload from the frame of the target block and drop the vars that were not watched
+// during the last MAX_IDLE_LOADS loads.
+class FstCursor
+{
+public:
+	static constexpr size_t MAX_IDLE_LOADS = 8;
+
+	FstCursor(const FstReader& reader) : reader(reader) {}
+
+	// tracks facid from now on, returns its slot or nullopt for reals. A new var is brought to the
+	// current time on its own, without reloading the others. The slot is valid until the next seek.
+	std::optional<size_t> watch(uint32_t facid);
+
+	void seek(uint64_t time);
+
+	// the value of a slot as nbits '0'/'1' chars plus a terminating zero, nullptr before the
+	// first block and after x or z changes, which only libfst can read
+	const char* value(size_t slot) const;
+
+private:
+	struct Event
+	{
+		uint32_t time;
+		uint32_t slot;
+		const byte_t* value;
+		// whether the changes it is from were all binary
+		bool binary;
+	};
+
+	const FstReader& reader;
+	uint64_t time = 0;
+	std::optional<size_t> block;
+	size_t loads = 0;
+
+	std::vector<uint32_t> facids;
+	std::unordered_map<uint32_t, size_t> slots;
+	std::string chars;
+	std::vector<size_t> offsets;
+	// the value of loads at the last watch of each slot
+	std::vector<size_t> last_watched;
+	// false once a change from non binary changes was applied to the slot
+	std::vector<bool> exact;
+
+	// keeps the event values alive
+	std::vector<std::shared_ptr<const FstDecodedChanges>> changes;
+	std::vector<Event> events;
+	size_t next_event = 0;
+
+	void load(std::optional<size_t> block_idx);
+	void drop_idle();
+	// sets the slot to its value at the start of the block and keeps the changes of its var in the
+	// block alive, which it returns
+	const FstDecodedChanges& reset(size_t slot);
+	void apply(const Event& event);
 };
 
 
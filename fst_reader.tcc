@@ -1,49 +1,211 @@
 #include <print>
+#include <ranges>
+#ifdef __SSE4_1__
+#include <varintdecode.h>
+#endif
+
+extern "C" {
+#include "libfst/fastlz.h"
+#include "libfst/lz4.h"
+}
 
 namespace impl {
 
 #include <zlib.h>
 
-template <typename F, bool takes_ownership = false>
-void with_maybe_uncompress(F&& f, const byte_t* data, uint64_t data_len, uint64_t uncompressed_len, bool should_decompress_override = false)
+template <typename F>
+void with_maybe_uncompress(F&& f, const byte_t* data, uint64_t data_len, uint64_t uncompressed_len, bool should_decompress_override = false, uint8_t packtype = 'Z')
 {
-	auto buf = data;
 	if ((data_len != uncompressed_len) or should_decompress_override) {
-		uLong uncompressed_len_own = uncompressed_len;
-		auto decompressed_buf = new byte_t[uncompressed_len_own];
-		auto ret = uncompress(decompressed_buf, &uncompressed_len_own, data, data_len);
-		assert(ret == Z_OK);
-		buf = decompressed_buf;
-	}
-
-	f(buf, uncompressed_len);
-
-	if constexpr (not takes_ownership) {
-		if (data_len != uncompressed_len) {
-			delete[] buf;
+		auto lease = BufferPool::acquire(uncompressed_len);
+		auto decompressed_buf = lease.data();
+		if (packtype == '4') {
+			[[maybe_unused]]
+			auto ret = LZ4_decompress_safe(
+			    reinterpret_cast<const char*>(data), reinterpret_cast<char*>(decompressed_buf),
+			    data_len, uncompressed_len);
+			assert(ret == (int) uncompressed_len);
+		} else if (packtype == 'F') {
+			[[maybe_unused]]
+			auto ret = fastlz_decompress(data, data_len, decompressed_buf, uncompressed_len);
+			assert(ret == (int) uncompressed_len);
+		} else {
+			uLong uncompressed_len_own = uncompressed_len;
+			[[maybe_unused]]
+			auto ret = uncompress(decompressed_buf, &uncompressed_len_own, data, data_len);
+			assert(ret == Z_OK);
 		}
+		f(static_cast<const byte_t*>(decompressed_buf), uncompressed_len);
+	} else {
+		f(data, uncompressed_len);
 	}
 }
 };
 
 template <std::invocable<const struct FstBlockByBlock&> F>
-void FstReader::block_by_block(F&& f) const
+void FstReader::block_by_block(F&& f, size_t first_block, size_t last_block) const
 {
-	for (auto& block : metadata->vcblocks) {
-		f(FstBlockByBlock{block.read_time_table(file_mmap()), block, *this});
+	last_block = std::min(last_block, metadata->vcblocks.size());
+	for (size_t i = first_block; i < last_block; i++) {
+		auto table = time_table(i);
+		f(FstBlockByBlock{*table, *metadata->vcblocks[i], *this});
 	}
 }
 
+template <std::invocable<const struct FstBlockByBlock&> D, class F>
+void FstReader::block_by_block_parallel(
+    D&& decode, F&& consume, size_t first_block, size_t last_block) const
+{
+	last_block = std::min(last_block, metadata->vcblocks.size());
+	auto indices = std::views::iota(std::min(first_block, last_block), last_block);
+	impl::ordered_parallel_for_each(
+	    indices.begin(), indices.end(), parallelism,
+	    [&](size_t i) {
+		    auto table = time_table(i);
+		    return decode(FstBlockByBlock{*table, *metadata->vcblocks[i], *this});
+	    },
+	    consume);
+}
+
 template <std::invocable<uint32_t, const byte_t *, uint16_t> F>
 void FstReader::read_values(uint32_t facid, F && f) const {
-    block_by_block([&](auto const & block) {
-      block.read_values(facid, std::forward<F>(f));
-    });
+	if (parallelism > 1 and metadata->vcblocks.size() > 1) {
+		block_by_block_parallel(
+		    [&](const FstBlockByBlock& block) { return block.decode(facid); },
+		    [&](const FstDecodedChanges& changes) { changes.replay(f); });
+	} else {
+		block_by_block([&](auto const& block) { block.read_values(facid, f); });
+	}
+}
+
+template <std::invocable<uint32_t, uint32_t, const byte_t*, uint16_t> F>
+void FstReader::read_values(std::span<const uint32_t> facids, F&& f, size_t first_block) const
+{
+	if (parallelism > 1 and metadata->vcblocks.size() > first_block + 1) {
+		block_by_block_parallel(
+		    [&](const FstBlockByBlock& block) {
+			    std::vector<FstDecodedChanges> changes;
+			    changes.reserve(facids.size());
+			    for (auto facid : facids) {
+				    changes.push_back(block.decode(facid));
+			    }
+			    return changes;
+		    },
+		    [&](const std::vector<FstDecodedChanges>& changes) {
+			    for (size_t i = 0; i < facids.size(); i++) {
+				    changes[i].replay([&](uint32_t time, const byte_t* data, uint16_t bytes) {
+					    f(facids[i], time, data, bytes);
+				    });
+			    }
+		    },
+		    first_block);
+	} else {
+		block_by_block([&](auto const& block) { block.read_values(facids, f); }, first_block);
+	}
 }
 
 template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
-void FstBlockByBlock::read_values(uint32_t facid, F&& f) const
+void FstReader::read_values(uint32_t facid, uint64_t t_begin, uint64_t t_end, F&& f) const
 {
+	// the geometry is only written on close, a live file has no widths yet
+	if (facid >= metadata->nbits.size()) {
+		return;
+	}
+	auto [first, last] = blocks_in(t_begin, t_end);
+
+	// the last change at or before t_begin, which is only reported once we know the window has
+	// started
+	std::vector<byte_t> live;
+	uint16_t live_bytes = 0;
+	bool have_live = false;
+	bool started = false;
+
+	auto start = [&] {
+		started = true;
+		// no change in the window up to t_begin, so the live value is the one the window starts
+		// with. That is the frame of the first block, or the final value of the last block if the
+		// window starts after it.
+		const auto& blocks = metadata->vcblocks;
+		if (not have_live and first < blocks.size() and
+		    (first > 0 or blocks[first]->start_time <= t_begin)) {
+			live_bytes = (metadata->nbits[facid] + 7) / 8;
+			live.resize(live_bytes);
+			have_live = checkpoint(first, facid, live.data());
+		} else if (not have_live and first == blocks.size() and first > 0) {
+			auto changes = cached_changes(first - 1, facid);
+			live_bytes = (metadata->nbits[facid] + 7) / 8;
+			if (changes->times.size() > 0) {
+				live.assign(changes->values.end() - changes->bytes, changes->values.end());
+				have_live = true;
+			} else {
+				live.resize(live_bytes);
+				have_live = checkpoint(first - 1, facid, live.data());
+			}
+		}
+		if (have_live) {
+			f(static_cast<uint32_t>(t_begin), live.data(), live_bytes);
+		}
+	};
+
+	auto on_change = [&](uint32_t time, const byte_t* data, uint16_t bytes) {
+		if (time <= t_begin) {
+			live.assign(data, data + bytes);
+			live_bytes = bytes;
+			have_live = true;
+		} else if (time <= t_end) {
+			if (not started) {
+				start();
+			}
+			f(time, data, bytes);
+		}
+	};
+
+	if (parallelism > 1 and last - first > 1) {
+		block_by_block_parallel(
+		    [&](const FstBlockByBlock& block) { return block.decode(facid); },
+		    [&](const FstDecodedChanges& changes) { changes.replay(on_change); }, first, last);
+	} else {
+		block_by_block([&](auto const& block) { block.read_values(facid, on_change); }, first, last);
+	}
+
+	if (not started) {
+		start();
+	}
+}
+
+template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
+void FstBlockByBlock::read_values(uint32_t facid, uint64_t t_begin, uint64_t t_end, F&& f) const
+{
+	if (block.end_time < t_begin or block.start_time > t_end) {
+		return;
+	}
+	read_values(facid, [&](uint32_t time, const byte_t* data, uint16_t bytes) {
+		if (time >= t_begin and time <= t_end) {
+			f(time, data, bytes);
+		}
+	});
+}
+
+template <std::invocable<uint32_t, uint32_t, const byte_t*, uint16_t> F>
+void FstBlockByBlock::read_values(std::span<const uint32_t> facids, F&& f) const
+{
+	for (auto facid : facids) {
+		read_values(facid, [&](uint32_t time, const byte_t* data, uint16_t bytes) {
+			f(facid, time, data, bytes);
+		});
+	}
+}
+
+template <std::invocable<uint32_t, const byte_t*, uint16_t> F>
+bool FstBlockByBlock::read_values(uint32_t facid, F&& f) const
+{
+	// no changes in this block, or the var was added after this block was written. A file that is
+	// still being written has no geometry yet, its values can only be read once it is closed.
+	if (facid >= block.wave_data_offset.size() or block.wave_data_offset[facid] <= 0 or
+	    facid >= reader.metadata->nbits.size()) {
+		return true;
+	}
+
 	auto bits = reader.metadata->nbits[facid];
 
 	// this is all a bit involved. Offset gives the offset to the start of the data for this
@@ -53,32 +215,37 @@ void FstBlockByBlock::read_values(uint32_t facid, F&& f) const
 	// however length stores the length including the varint, so we need to subtract the length
 	// of the varint from the stored length to get the length of the zlib compressed data
 	auto offset = block.wave_data_offset[facid];
-	const byte_t* data_offset = reader.file_mmap() + offset;
+	const byte_t* data_start = reader.file_mmap(block.segment) + offset;
+	const byte_t* data_offset = data_start;
 
 	auto uncompressed_len = impl::read_varint(data_offset);
-	auto read = data_offset - reader.file_mmap() - offset;
+	auto read = data_offset - data_start;
 	auto compressed_len = block.wave_data_compressed_length[facid] - read;
 	auto is_compressed = uncompressed_len > 0;
 
 	// if zero, its not actually compressed
 	uncompressed_len = is_compressed ? uncompressed_len : compressed_len;
 
+	bool binary = true;
 	impl::with_maybe_uncompress(
 	    [&](const byte_t* data, auto n) {
 		    if (bits == 1) {
-			    read_block_single_bit(time_table, data, n, f);
+			    binary = read_block_single_bit(time_table, data, n, f);
 		    } else {
-			    read_block_multi_bit(time_table, data, n, (bits + 7) / 8, f);
+			    binary = read_block_multi_bit(time_table, data, n, bits, f);
 		    }
 	    },
-	    data_offset, compressed_len, uncompressed_len, is_compressed);
+	    data_offset, compressed_len, uncompressed_len, is_compressed, block.packtype);
 	// important: event if compressed_len == uncompressed_len, its compressed (wtf???)
+	return binary;
 };
 
 template <typename T>
 std::pair<std::vector<uint32_t>, std::vector<T>> FstBlockByBlock::read_values(uint32_t facid) const
 {
-	assert(sizeof(T) >= (uint32_t) (reader.metadata->nbits[facid] + 7) / 8);
+	assert(
+	    facid >= reader.metadata->nbits.size() or
+	    sizeof(T) >= (uint32_t) (reader.metadata->nbits[facid] + 7) / 8);
 	auto max_changes = block.end_time - block.start_time + 1; // this range is inclusive
 	std::vector<uint32_t> times(max_changes);
 	std::vector<T> vals(max_changes);
@@ -101,34 +268,90 @@ std::pair<std::vector<uint32_t>, std::vector<T>> FstBlockByBlock::read_values(ui
 	return {times, vals};
 }
 
+// a change is a varint of the time index delta and the value. If its lowest bit is clear, the next
+// one is the 0/1 value. Otherwise the next three select one of "xzhuwl-?", which are passed as 0.
+// Returns false if there was such a non binary change.
 template <class F>
-void read_block_single_bit(const std::vector<uint32_t> & time_table, const byte_t* data, size_t n, F&& f)
+bool read_block_single_bit(const std::vector<uint32_t> & time_table, const byte_t* data, size_t n, F&& f)
 {
+	// the value bit, shifted to have same format as binary multibit
+	static constexpr byte_t values[2] = {0, 0b1000'0000};
+	bool binary = true;
+#ifdef __SSE4_1__
+	// every change is a single varint, so the whole stream can be decoded in bulk. Each varint is at
+	// least one byte, the slack is for the vector stores of the decoder.
+	auto lease = impl::BufferPool::acquire((n + 16) * sizeof(uint32_t));
+	auto vars = reinterpret_cast<uint32_t*>(lease.data());
+	auto count = masked_vbyte_decode_fromcompressedsize(data, vars, n);
+	uint32_t time_idx = 0;
+	for (size_t i = 0; i < count; i++) {
+		auto var = vars[i];
+		if (var & 1) [[unlikely]] {
+			binary = false;
+			time_idx += var >> 4;
+			f(time_table[time_idx], &values[0], 1);
+		} else {
+			time_idx += var >> 2;
+			f(time_table[time_idx], &values[(var >> 1) & 0b1], 1);
+		}
+	}
+#else
 	auto end = data + n;
 	auto time_idx = 0;
 	while (data < end) {
 		auto var = impl::read_varint(data);
-		assert((var & 1) == 0);
+		if (var & 1) [[unlikely]] {
+			binary = false;
+			time_idx += var >> 4;
+			f(time_table[time_idx], &values[0], 1);
+			continue;
+		}
 		auto combined_value = var >> 1;
 		auto time_idx_delta = combined_value >> 1;
-		// shift to have same format as binary multibit
-		byte_t value = (combined_value & 0b1) << 7;
 		time_idx += time_idx_delta;
 
-		f(time_table[time_idx], &value, 1);
+		f(time_table[time_idx], &values[combined_value & 0b1], 1);
 	}
+#endif
+	return binary;
 }
 
+// a change is a varint of the time index delta and the format. If its lowest bit is set, the value
+// follows packed msb first. Otherwise it is one '0'/'1'/'x'/'z'/... char per bit, which is packed
+// with the non binary chars as 0. Returns false if there was such a change.
 template <class F>
-void read_block_multi_bit(const
-    std::vector<uint32_t> & time_table, const byte_t* data, size_t n, size_t bytes, F&& f)
+bool read_block_multi_bit(const
+    std::vector<uint32_t> & time_table, const byte_t* data, size_t n, uint32_t nbits, F&& f)
 {
+	auto bytes = (nbits + 7) / 8;
 	auto end = data + n;
 	auto time_idx = 0;
+	bool binary = true;
+	std::vector<byte_t> packed;
 	while (data < end) {
-		auto time_idx_delta = impl::read_varint(data) >> 1;
-		time_idx += time_idx_delta;
-		f(time_table[time_idx], data, bytes);
-		data += bytes;
+		// the varints are interleaved with the values, so no bulk decode here. Most deltas fit in a
+		// single byte though.
+		uint64_t var;
+		if (not(*data & 0b1000'0000)) [[likely]] {
+			var = *data++;
+		} else {
+			var = impl::read_varint(data);
+		}
+		time_idx += var >> 1;
+		if ((var & 1) or nbits == 0) [[likely]] {
+			f(time_table[time_idx], data, bytes);
+			data += bytes;
+		} else {
+			binary = false;
+			packed.assign(bytes, 0);
+			for (uint32_t i = 0; i < nbits; i++) {
+				if (data[i] == '1') {
+					packed[i / 8] |= 0b1000'0000 >> (i % 8);
+				}
+			}
+			f(time_table[time_idx], packed.data(), bytes);
+			data += nbits;
+		}
 	}
+	return binary;
 }
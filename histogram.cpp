@@ -21,16 +21,16 @@ void Histograms::render()
 	        [](auto& hist_id) { return not std::get<0>(hist_id).open; });
 }
 
-Histogram::Histogram(Highlights* highlights, std::shared_ptr<FstFile> fstfile, const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge) :
+Histogram::Histogram(Highlights* highlights, const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge) :
     highlights(highlights), var(var), sampling_var(sampling_var), conditions(conditions), masks(masks), data_future{std::async(std::launch::async, [=] {
-	    FstFile my_fstfile(*fstfile);
+	    FstFile my_fstfile(*var.owner_node->ctx);
 	    auto [times, data] = my_fstfile.read_values<uint32_t>(var, sampling_var, conditions, masks, negedge);
 	    return DataT{data, times};
     })}
 {
 }
 
-Histogram::Histogram(Highlights* highlights, std::shared_ptr<FstFile>, std::string name, std::vector<NodeVar> used, std::span<const DataT::simtime_t> times, std::span<const DataT::value_t> values) :
+Histogram::Histogram(Highlights* highlights, std::string name, std::vector<NodeVar> used, std::span<const DataT::simtime_t> times, std::span<const DataT::value_t> values) :
     highlights(highlights), extra(used), extra_name(name), data_future{resolved_future(DataT{values, times})}
 {
 }
@@ -196,8 +196,7 @@ void Histogram::set_query(decltype(query) new_value)
 	}
 }
 
-Histograms::Histograms(std::shared_ptr<FstFile> fstfile, Highlights* highlights) :
-    fstfile(fstfile), highlights(highlights)
+Histograms::Histograms(Highlights* highlights) : highlights(highlights)
 {
 }
 
@@ -51,8 +51,9 @@ private:
 	void update_highlights();
 
 public:
-	Histogram(Highlights* highlights, std::shared_ptr<FstFile> fstfile, const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge);
-	Histogram(Highlights* highlights, std::shared_ptr<FstFile> fstfile, std::string name, std::vector<NodeVar> used, std::span<const DataT::simtime_t> times, std::span<const DataT::value_t> values);
+	// var, sampling_var, conditions and masks have to be in the same file
+	Histogram(Highlights* highlights, const NodeVar& var, const NodeVar& sampling_var, std::vector<NodeVar> conditions, std::vector<NodeVar> masks, bool negedge);
+	Histogram(Highlights* highlights, std::string name, std::vector<NodeVar> used, std::span<const DataT::simtime_t> times, std::span<const DataT::value_t> values);
 
 	bool render(int id);
 };
@@ -62,17 +63,16 @@ struct Histograms
 private:
 	std::vector<std::pair<Histogram, int>> histograms;
 	int id_gen = 0;
-	std::shared_ptr<FstFile> fstfile;
 	Highlights* highlights;
 
 public:
-	Histograms(std::shared_ptr<FstFile> fstfile, Highlights* highlights);
+	Histograms(Highlights* highlights);
 
 	using DataT = Histogram::DataT;
 
 	template<class... Args>
 	void add(Args && ...args) {
-		histograms.emplace_back(std::piecewise_construct, std::forward_as_tuple(highlights, fstfile, std::forward<Args>(args)...), std::forward_as_tuple(id_gen++));
+		histograms.emplace_back(std::piecewise_construct, std::forward_as_tuple(highlights, std::forward<Args>(args)...), std::forward_as_tuple(id_gen++));
 	}
 
 	void render();
@@ -1,40 +1,205 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <format>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
 #include <unordered_map>
+#include <vector>
+
+struct CacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  // entries not cached as they alone are over the budget
+  uint64_t dropped;
+  // summed size of the entries currently held
+  uint64_t bytes;
+};
 
-template <class KeyT, class DataT>
-class LruCache {
-  using age_t = uint64_t;
+// Thread safe LRU cache bounded by the summed byte size of its entries. Entries are handed out as
+// shared pointers, so evicting one never invalidates a reader that is still using it.
+template <class KeyT, class DataT, class Hash = std::hash<KeyT>>
+class BudgetedCache {
+  using entry_t = std::tuple<KeyT, std::shared_ptr<const DataT>, size_t>;
 
-  size_t cap;
-  age_t clock = 1;
-  std::vector<KeyT> usage;
-  std::unordered_map<KeyT, std::pair<age_t, DataT>> data;
+  size_t budget;
+  size_t used = 0;
+  std::mutex mutex;
+  // most recently used at the front
+  std::list<entry_t> lru;
+  std::unordered_map<KeyT, typename std::list<entry_t>::iterator, Hash> index;
 
 public:
-  LruCache(size_t cap) : cap(cap) {}
-
-  const DataT* get(KeyT key) {
-    auto it = data.find(key);
-    if (it != data.end()) {
-      it->second.first = clock++;
-      return &it->second.second;
-    } else {
+  // what an add pushed out, the bytes include those of a replaced entry
+  struct Evicted {
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  BudgetedCache(size_t budget) : budget(budget) {}
+
+  std::shared_ptr<const DataT> get(const KeyT & key) {
+    auto guard = std::lock_guard(mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
       return nullptr;
     }
+    lru.splice(lru.begin(), lru, it->second);
+    return std::get<1>(*it->second);
+  }
+
+  // an entry larger than the whole budget is not cached
+  Evicted add(const KeyT & key, std::shared_ptr<const DataT> new_data, size_t bytes) {
+    Evicted evicted;
+    if (bytes > budget) {
+      return evicted;
+    }
+    auto guard = std::lock_guard(mutex);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      evicted.bytes += std::get<2>(*it->second);
+      used -= std::get<2>(*it->second);
+      lru.erase(it->second);
+      index.erase(it);
+    }
+    lru.emplace_front(key, std::move(new_data), bytes);
+    index.emplace(key, lru.begin());
+    used += bytes;
+    while (used > budget) {
+      evicted.bytes += pop_oldest();
+      evicted.entries++;
+    }
+    return evicted;
+  }
+
+  // evicts the least recently used entry unless it is `keep`, returns its size or 0 if nothing
+  // was evicted
+  size_t evict_oldest(const KeyT & keep) {
+    auto guard = std::lock_guard(mutex);
+    if (lru.empty() or std::get<0>(lru.back()) == keep) {
+      return 0;
+    }
+    return pop_oldest();
+  }
+
+  // returns the bytes freed
+  size_t clear() {
+    auto guard = std::lock_guard(mutex);
+    lru.clear();
+    index.clear();
+    return std::exchange(used, 0);
+  }
+
+  size_t bytes() {
+    auto guard = std::lock_guard(mutex);
+    return used;
   }
 
-  void add(KeyT key, DataT new_data) {
-    if (usage.size() > cap) {
-      KeyT to_remove;
-      age_t oldest = std::numeric_limits<age_t>::max();
-      for (auto & [key, value] : data) {
-        auto & [age, _] = value;
-        if (age < oldest) {
-          to_remove = key;
-          oldest = age;
+private:
+  size_t pop_oldest() {
+    auto & [old_key, _, old_bytes] = lru.back();
+    auto freed = old_bytes;
+    used -= old_bytes;
+    index.erase(old_key);
+    lru.pop_back();
+    return freed;
+  }
+};
+
+// BudgetedCache split into shards by key hash, so concurrent readers rarely contend on a lock. The
+// shards share one budget: a shard may hold far more than its share, e.g. a single long signal, the
+// others then give up their oldest entries. Only an entry larger than the whole budget is dropped.
+template <class KeyT, class DataT, class Hash = std::hash<KeyT>, size_t Shards = 16>
+class ShardedCache {
+  using shard_t = BudgetedCache<KeyT, DataT, Hash>;
+
+  size_t budget;
+  std::array<std::unique_ptr<shard_t>, Shards> shards;
+  // summed over the shards, kept here so an add does not have to lock all of them
+  std::atomic<size_t> used{0};
+  // the shard to evict from next, so the shards give up entries in turn
+  std::atomic<size_t> next_victim{0};
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> evictions{0};
+  std::atomic<uint64_t> dropped{0};
+
+  shard_t & shard(const KeyT & key) {
+    // mixed, as std::hash is the identity for integers and the low bits also select the bucket
+    // inside the shard
+    uint64_t h = Hash{}(key) * 0x9e37'79b9'7f4a'7c15ULL;
+    return *shards[(h >> 32) % Shards];
+  }
+
+public:
+  ShardedCache(size_t budget) : budget(budget) {
+    for (auto & shard : shards) {
+      shard = std::make_unique<shard_t>(budget);
+    }
+  }
+
+  std::shared_ptr<const DataT> get(const KeyT & key) {
+    auto found = shard(key).get(key);
+    (found ? hits : misses)++;
+    return found;
+  }
+
+  void add(const KeyT & key, std::shared_ptr<const DataT> new_data, size_t bytes) {
+    if (bytes > budget) {
+      dropped++;
+      return;
+    }
+    auto evicted = shard(key).add(key, std::move(new_data), bytes);
+    evictions += evicted.entries;
+    used += bytes;
+    used -= evicted.bytes;
+
+    // a sweep that frees nothing means the new entry is all that is left
+    while (used > budget) {
+      size_t freed = 0;
+      for (size_t i = 0; i < Shards and used > budget; i++) {
+        auto bytes_freed = shards[next_victim++ % Shards]->evict_oldest(key);
+        if (bytes_freed > 0) {
+          used -= bytes_freed;
+          evictions++;
+          freed += bytes_freed;
         }
       }
-      data.erase(to_remove);
+      if (freed == 0) {
+        break;
+      }
     }
-    data.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(0, std::move(new_data)));
+  }
+
+  void clear() {
+    for (auto & shard : shards) {
+      used -= shard->clear();
+    }
+  }
+
+  CacheStats stats() {
+    uint64_t bytes = 0;
+    for (auto & shard : shards) {
+      bytes += shard->bytes();
+    }
+    return {hits, misses, evictions, dropped, bytes};
+  }
+};
+
+template <>
+struct std::formatter<CacheStats, char> {
+  constexpr auto parse(std::format_parse_context & ctx) { return ctx.begin(); }
+
+  auto format(const auto & s, auto & ctx) const {
+    auto lookups = s.hits + s.misses;
+    return std::format_to(
+        ctx.out(), "{} lookups, {:.1f}% hits, {} evictions, {} dropped as too large, {:.1f}MiB held",
+        lookups, lookups ? 100.0 * s.hits / lookups : 0.0, s.evictions, s.dropped,
+        s.bytes / (1024.0 * 1024.0));
   }
 };
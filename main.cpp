@@ -22,11 +22,13 @@
 
 #include "fonts.h"
 #include "fst_file.h"
+#include "trace.h"
 #include "nodes_panel.h"
 #include "waveform_viewer.h"
 #include "histogram.h"
 #include "highlights.h"
 #include "async_runner.h"
+#include "preindexer.h"
 
 #include <pybind11/embed.h>
 namespace py = pybind11;
@@ -45,16 +47,24 @@ void signalHandler(int signum)
 namespace po = boost::program_options;
 int main(int ac, char ** av) {
     po::options_description desc("Allowed options");
-    std::string filename;
+    std::vector<std::string> filenames;
     std::string module_name;
     bool run_script = false;
+    size_t cache_mb = FstFile::DEFAULT_CACHE_BYTES >> 20;
+    bool preindex = false;
+    size_t preindex_mb = Preindexer::DEFAULT_BUDGET_BYTES >> 20;
+    std::vector<std::string> preindex_scopes;
 
     // TODO(robin): configure link latency
     desc.add_options()
         ("help", "produce help message")
         ("run_script", po::value<bool>(&run_script), "input file")
-        ("file", po::value<std::string>(&filename)->required(), "input file")
+        ("file", po::value<std::vector<std::string>>(&filenames)->required()->composing(), "input file, directory of them or comma separated files of a time split trace, can be repeated for traces dumped per node")
         ("module", po::value<std::string>(&module_name)->required(), "python debug module")
+        ("cache_mb", po::value<size_t>(&cache_mb)->default_value(cache_mb), "memory cap of the decoded signal cache in MiB")
+        ("preindex", po::bool_switch(&preindex), "build the waveform databases of all vars in the background. They stay in memory until the var is added, up to --preindex_mb, and are saved in the sidecar index on exit")
+        ("preindex_mb", po::value<size_t>(&preindex_mb)->default_value(preindex_mb), "memory cap of the preindexed databases not added yet in MiB, preindexing pauses when it is reached")
+        ("preindex_scope", po::value<std::vector<std::string>>(&preindex_scopes)->composing(), "only preindex the vars inside this dot separated scope of each node, can be repeated")
     ;
 
     po::variables_map vm;
@@ -70,19 +80,26 @@ int main(int ac, char ** av) {
 	auto imgui_module = py::module::import("imgui");
 
 	AsyncRunner async_runner;
-	auto f = std::make_shared<FstFile>(filename.c_str());
+	auto trace = std::make_shared<Trace>(filenames, cache_mb << 20);
 	Highlights highlights;
-	WaveformViewer waveform_viewer(f, &highlights);
-	Histograms histograms(f, &highlights);
-	NodesPanel panel(f->read_nodes(&waveform_viewer, &histograms, &async_runner));
+	WaveformViewer waveform_viewer(trace, &highlights);
+	Histograms histograms(&highlights);
+	NodesPanel panel(trace->read_nodes(&waveform_viewer, &histograms, &async_runner));
 
 	auto process_func = module.attr("process");
 	if (run_script) {
 		auto main_func = module.attr("__main__");
 		main_func(panel.nodes);
+		trace->save_index(waveform_viewer.wave_dbs());
 		return 0;
 	}
 
+	if (preindex or not preindex_scopes.empty()) {
+		waveform_viewer.set_preindexer(
+		    std::make_shared<Preindexer>(
+		        Preindexer::vars_under(panel.nodes, preindex_scopes), preindex_mb << 20));
+	}
+
 
 	glfwSetErrorCallback(glfw_error_callback);
 	if (!glfwInit())
@@ -221,5 +238,7 @@ int main(int ac, char ** av) {
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
+	trace->save_index(waveform_viewer.wave_dbs());
+
 	return 0;
 }
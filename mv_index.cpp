@@ -0,0 +1,391 @@
+#include "mv_index.h"
+#include "fst_reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <print>
+
+struct MvIndex::Header
+{
+	char magic[8];
+	uint64_t fst_size;
+	int64_t fst_mtime;
+	uint64_t metadata_offset;
+	uint64_t metadata_size;
+	uint64_t hierarchy_offset;
+	uint64_t hierarchy_size;
+	uint64_t dbs_offset;
+	uint64_t dbs_count;
+};
+
+struct MvIndex::DbEntry
+{
+	uint32_t handle;
+	uint32_t count;
+	uint64_t offset;
+	uint64_t kind;
+};
+
+namespace {
+// the last byte is the version
+constexpr char MAGIC[8] = {'M', 'V', 'I', 'D', 'X', 0, 0, 1};
+
+// whether [offset, offset + len) is inside an index of size bytes, without overflowing
+bool in_bounds(uint64_t offset, uint64_t len, uint64_t size)
+{
+	return offset <= size and len <= size - offset;
+}
+
+std::optional<int64_t> mtime_of(const std::string& path)
+{
+	std::error_code ec;
+	auto time = std::filesystem::last_write_time(path, ec);
+	if (ec) {
+		return std::nullopt;
+	}
+	return time.time_since_epoch().count();
+}
+
+// every section and array starts 8 byte aligned, so the arrays can be used in place from the
+// mapping
+class IndexWriter
+{
+public:
+	IndexWriter(const std::string& path) : out(path, std::ios::binary | std::ios::trunc) {}
+
+	template <class T>
+	void put(const T& value)
+	{
+		write(&value, sizeof(T));
+	}
+
+	template <class T>
+	void put_span(std::span<const T> values)
+	{
+		put<uint64_t>(values.size());
+		write(values.data(), values.size_bytes());
+		align();
+	}
+
+	void write(const void* data, size_t n)
+	{
+		out.write(static_cast<const char*>(data), n);
+		pos += n;
+	}
+
+	void align()
+	{
+		static constexpr char zeros[8] = {};
+		write(zeros, (8 - pos % 8) % 8);
+	}
+
+	uint64_t tell() const
+	{
+		return pos;
+	}
+
+	void put_header(const MvIndex::Header& header)
+	{
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+
+	bool good() const
+	{
+		return out.good();
+	}
+
+private:
+	std::ofstream out;
+	uint64_t pos = 0;
+};
+
+// reads a section of the index, a read past its end reads zeros and marks the reader as failed
+class IndexReader
+{
+public:
+	IndexReader(const byte_t* base, uint64_t pos, uint64_t end) : base(base), pos(pos), end(end) {}
+
+	bool failed() const
+	{
+		return overrun;
+	}
+
+	uint64_t remaining() const
+	{
+		return overrun ? 0 : end - pos;
+	}
+
+	template <class T>
+	T get()
+	{
+		T value{};
+		if (take(sizeof(T))) {
+			std::memcpy(&value, base + pos - sizeof(T), sizeof(T));
+		}
+		return value;
+	}
+
+	template <class T>
+	std::span<const T> get_span()
+	{
+		auto n = get<uint64_t>();
+		if (pos % alignof(T) != 0 or n > remaining() / sizeof(T) or not take(n * sizeof(T))) {
+			overrun = true;
+			return {};
+		}
+		std::span<const T> values(reinterpret_cast<const T*>(base + pos - n * sizeof(T)), n);
+		take(std::min<uint64_t>((8 - pos % 8) % 8, remaining()));
+		return values;
+	}
+
+private:
+	const byte_t* base;
+	uint64_t pos;
+	uint64_t end;
+	bool overrun = false;
+
+	bool take(uint64_t n)
+	{
+		if (overrun or not in_bounds(pos, n, end)) {
+			overrun = true;
+			return false;
+		}
+		pos += n;
+		return true;
+	}
+};
+
+void write_metadata(IndexWriter& w, const FstMetaData& metadata)
+{
+	w.put<uint64_t>(metadata.start_time);
+	w.put<uint64_t>(metadata.end_time);
+	w.put<uint64_t>(metadata.num_ids);
+	w.put<uint64_t>(metadata.scanned_until);
+	auto hierarchy = metadata.hierarchy;
+	w.put<uint64_t>(hierarchy.has_value());
+	w.put<uint64_t>(hierarchy ? (uint64_t) hierarchy->ty : 0);
+	w.put<uint64_t>(hierarchy ? hierarchy->len : 0);
+	w.put<uint64_t>(hierarchy ? hierarchy->data_start() : 0);
+	w.put_span<uint16_t>(metadata.nbits);
+	w.put_span<uint32_t>(metadata.frame_offsets);
+
+	w.put<uint64_t>(metadata.vcblocks.size());
+	for (const auto& block : metadata.vcblocks) {
+		w.put<uint64_t>(block->start_time);
+		w.put<uint64_t>(block->end_time);
+		w.put<uint64_t>(block->bits_uncompressed_length);
+		w.put<uint64_t>(block->bits_compressed_length);
+		w.put<uint64_t>(block->bits_count);
+		w.put<uint64_t>(block->bits_data_pos);
+		w.put<uint64_t>(block->time_uncompressed_length);
+		w.put<uint64_t>(block->time_compressed_length);
+		w.put<uint64_t>(block->time_count);
+		w.put<uint64_t>(block->time_data_pos);
+		w.put<uint64_t>(block->wave_data_pos);
+		w.put<uint64_t>(block->packtype);
+		w.put_span<int64_t>(block->wave_data_offset);
+		w.put_span<uint32_t>(block->wave_data_compressed_length);
+	}
+}
+}
+
+std::shared_ptr<const MvIndex> MvIndex::open(const std::string& fst_path)
+{
+	auto path = path_for(fst_path);
+	std::error_code ec;
+	if (not std::filesystem::exists(path, ec)) {
+		return nullptr;
+	}
+
+	auto index = std::make_shared<MvIndex>();
+	try {
+		index->mapped = std::make_shared<bip::mapped_region>(
+		    bip::file_mapping(path.c_str(), bip::read_only), bip::read_only);
+	} catch (const bip::interprocess_exception& e) {
+		std::println("could not map {}: {}", path, e.what());
+		return nullptr;
+	}
+
+	auto size = index->mapped->get_size();
+	if (size < sizeof(Header) or std::memcmp(index->header().magic, MAGIC, sizeof(MAGIC)) != 0) {
+		return nullptr;
+	}
+	const auto& header = index->header();
+	if (not in_bounds(header.metadata_offset, header.metadata_size, size) or
+	    not in_bounds(header.hierarchy_offset, header.hierarchy_size, size) or
+	    header.dbs_offset % alignof(DbEntry) != 0 or
+	    header.dbs_count > size / sizeof(DbEntry) or
+	    not in_bounds(header.dbs_offset, header.dbs_count * sizeof(DbEntry), size)) {
+		std::println("ignoring corrupt {}", path);
+		return nullptr;
+	}
+
+	auto fst_size = std::filesystem::file_size(fst_path, ec);
+	if (ec or fst_size != header.fst_size or mtime_of(fst_path) != header.fst_mtime) {
+		std::println("ignoring outdated {}", path);
+		return nullptr;
+	}
+	return index;
+}
+
+void MvIndex::write(
+    const std::string& fst_path,
+    uint64_t fst_size,
+    const FstMetaData& metadata,
+    std::string_view hierarchy,
+    const std::map<uint32_t, Db>& dbs)
+{
+	std::error_code ec;
+	auto size = std::filesystem::file_size(fst_path, ec);
+	auto mtime = mtime_of(fst_path);
+	if (ec or size != fst_size or not mtime) {
+		return;
+	}
+
+	// written next to it and renamed, so a concurrent open never sees half an index
+	auto path = path_for(fst_path);
+	auto tmp_path = path + ".tmp";
+	{
+		IndexWriter w(tmp_path);
+		Header header{};
+		std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.fst_size = fst_size;
+		header.fst_mtime = *mtime;
+		w.put(header);
+
+		header.metadata_offset = w.tell();
+		write_metadata(w, metadata);
+		header.metadata_size = w.tell() - header.metadata_offset;
+
+		header.hierarchy_offset = w.tell();
+		w.write(hierarchy.data(), hierarchy.size());
+		header.hierarchy_size = hierarchy.size();
+		w.align();
+
+		std::vector<DbEntry> entries;
+		entries.reserve(dbs.size());
+		for (const auto& [handle, db] : dbs) {
+			entries.push_back({handle, static_cast<uint32_t>(db.values.size()), w.tell(), db.kind});
+			w.write(db.values.data(), db.values.size_bytes());
+			w.align();
+		}
+		// sorted by handle, as the map is
+		header.dbs_offset = w.tell();
+		header.dbs_count = entries.size();
+		w.write(entries.data(), entries.size() * sizeof(DbEntry));
+
+		w.put_header(header);
+		if (not w.good()) {
+			std::println("could not write {}", tmp_path);
+			std::filesystem::remove(tmp_path, ec);
+			return;
+		}
+	}
+	std::filesystem::rename(tmp_path, path, ec);
+	if (ec) {
+		std::println("could not write {}: {}", path, ec.message());
+	}
+}
+
+const MvIndex::Header& MvIndex::header() const
+{
+	return *reinterpret_cast<const Header*>(base());
+}
+
+std::span<const MvIndex::DbEntry> MvIndex::entries() const
+{
+	return {reinterpret_cast<const DbEntry*>(base() + header().dbs_offset), header().dbs_count};
+}
+
+uint64_t MvIndex::fst_size() const
+{
+	return header().fst_size;
+}
+
+std::optional<FstMetaData> MvIndex::metadata() const
+{
+	IndexReader r(base(), header().metadata_offset, header().metadata_offset + header().metadata_size);
+	FstMetaData metadata;
+	metadata.start_time = r.get<uint64_t>();
+	metadata.end_time = r.get<uint64_t>();
+	metadata.num_ids = r.get<uint64_t>();
+	metadata.scanned_until = r.get<uint64_t>();
+	auto has_hierarchy = r.get<uint64_t>();
+	auto hierarchy_ty = static_cast<FstBlockType>(r.get<uint64_t>());
+	auto hierarchy_len = r.get<uint64_t>();
+	auto hierarchy_start = r.get<uint64_t>();
+	if (has_hierarchy) {
+		metadata.hierarchy.emplace(hierarchy_ty, hierarchy_len, hierarchy_start);
+	}
+	auto nbits = r.get_span<uint16_t>();
+	metadata.nbits.assign(nbits.begin(), nbits.end());
+	auto frame_offsets = r.get_span<uint32_t>();
+	metadata.frame_offsets.assign(frame_offsets.begin(), frame_offsets.end());
+
+	// every block takes at least its 12 scalars and 2 span lengths
+	auto num_blocks = r.get<uint64_t>();
+	if (r.failed() or metadata.frame_offsets.size() != metadata.nbits.size() or
+	    num_blocks > r.remaining() / (14 * sizeof(uint64_t))) {
+		return std::nullopt;
+	}
+	metadata.vcblocks.reserve(num_blocks);
+	for (uint64_t i = 0; i < num_blocks and not r.failed(); i++) {
+		auto block = std::make_shared<FstVCBlockInfo>();
+		block->start_time = r.get<uint64_t>();
+		block->end_time = r.get<uint64_t>();
+		block->bits_uncompressed_length = r.get<uint64_t>();
+		block->bits_compressed_length = r.get<uint64_t>();
+		block->bits_count = r.get<uint64_t>();
+		block->bits_data_pos = r.get<uint64_t>();
+		block->time_uncompressed_length = r.get<uint64_t>();
+		block->time_compressed_length = r.get<uint64_t>();
+		block->time_count = r.get<uint64_t>();
+		block->time_data_pos = r.get<uint64_t>();
+		block->wave_data_pos = r.get<uint64_t>();
+		block->packtype = r.get<uint64_t>();
+		auto offsets = r.get_span<int64_t>();
+		block->wave_data_offset.assign(offsets.begin(), offsets.end());
+		auto lengths = r.get_span<uint32_t>();
+		block->wave_data_compressed_length.assign(lengths.begin(), lengths.end());
+		metadata.vcblocks.push_back(std::move(block));
+	}
+	if (r.failed()) {
+		return std::nullopt;
+	}
+	return metadata;
+}
+
+std::string_view MvIndex::hierarchy() const
+{
+	return {reinterpret_cast<const char*>(base() + header().hierarchy_offset), header().hierarchy_size};
+}
+
+std::optional<MvIndex::Db> MvIndex::wave_db(uint32_t handle) const
+{
+	auto all = entries();
+	auto entry = std::lower_bound(all.begin(), all.end(), handle, [](const DbEntry& entry, uint32_t handle) {
+		return entry.handle < handle;
+	});
+	if (entry == all.end() or entry->handle != handle) {
+		return std::nullopt;
+	}
+	if (entry->offset % alignof(uint32_t) != 0 or
+	    not in_bounds(entry->offset, uint64_t(entry->count) * sizeof(uint32_t), mapped->get_size())) {
+		return std::nullopt;
+	}
+	return Db{
+	    static_cast<uint8_t>(entry->kind),
+	    {reinterpret_cast<const uint32_t*>(base() + entry->offset), entry->count}};
+}
+
+std::vector<uint32_t> MvIndex::handles() const
+{
+	std::vector<uint32_t> handles;
+	for (const auto& entry : entries()) {
+		handles.push_back(entry.handle);
+	}
+	return handles;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct FstMetaData;
+
+// on disk index next to an fst file (trace.fst.mvidx), so reopening a trace skips parsing the
+// blocks and the hierarchy and building the wave databases of vars seen before. It is mmapped and
+// only the parts that are asked for are read. Only used if the size and modification time of the
+// fst file still match.
+//
+// written in native byte order, it is not meant to be moved between machines
+class MvIndex
+{
+public:
+	// the database of one var
+	struct Db
+	{
+		// which database was chosen, so it does not need to be benchmarked again
+		uint8_t kind;
+		// packed WaveValues
+		std::span<const uint32_t> values;
+	};
+
+	// the index of fst_path, nullptr if there is none or it does not match the file
+	static std::shared_ptr<const MvIndex> open(const std::string& fst_path);
+
+	// writes the index of fst_path, replacing any old one. fst_size is the size the metadata
+	// covers, nothing is written if the file has a different size by now.
+	static void write(
+	    const std::string& fst_path,
+	    uint64_t fst_size,
+	    const FstMetaData& metadata,
+	    std::string_view hierarchy,
+	    const std::map<uint32_t, Db>& dbs);
+
+	static std::string path_for(const std::string& fst_path)
+	{
+		return fst_path + ".mvidx";
+	}
+
+	uint64_t fst_size() const;
+
+	// nullopt if the stored metadata does not fit in the index, like for an outdated index
+	std::optional<FstMetaData> metadata() const;
+
+	// the decompressed hierarchy, empty if the file has none
+	std::string_view hierarchy() const;
+
+	// nullopt if there is none for handle or its values do not fit in the index
+	std::optional<Db> wave_db(uint32_t handle) const;
+
+	std::vector<uint32_t> handles() const;
+
+	struct Header;
+	struct DbEntry;
+
+private:
+	std::shared_ptr<boost::interprocess::mapped_region> mapped;
+
+	const uint8_t* base() const
+	{
+		return static_cast<const uint8_t*>(mapped->get_address());
+	}
+	const Header& header() const;
+	std::span<const DbEntry> entries() const;
+};
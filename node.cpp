@@ -75,7 +75,12 @@ std::span<char> NodeVar::format(char* value) const
 
 char* Node::get_current_var_value(const NodeVar& var)
 {
-	return value_at_time(var, current_time);
+	return ctx->get_current_value(var, current_time);
+}
+
+std::vector<std::string> Node::get_current_var_values(const std::vector<NodeVar>& vars)
+{
+	return ctx->snapshot(vars, current_time);
 }
 
 char* Node::value_at_time(const NodeVar& var, simtime_t time)
@@ -88,6 +93,11 @@ void Node::add_var_to_viewer(const NodeVar& var)
 	viewer->add(var);
 }
 
+void Node::add_vars_to_viewer(const std::vector<NodeVar>& vars)
+{
+	viewer->add(std::span<const NodeVar>(vars));
+}
+
 Node::Node(
     int x,
     int y,
@@ -49,10 +49,15 @@ struct Node : public std::enable_shared_from_this<Node>
 
 	char* get_current_var_value(const NodeVar& var);
 
+	// all values at current_time in one pass
+	std::vector<std::string> get_current_var_values(const std::vector<NodeVar>& vars);
+
 	char* value_at_time(const NodeVar& var, simtime_t time);
 
 	void add_var_to_viewer(const NodeVar& var);
 
+	void add_vars_to_viewer(const std::vector<NodeVar>& vars);
+
 	template<class ...Args>
 	void add_hist(Args && ...args);
 
@@ -6,6 +6,7 @@ NodeVar::NodeVar(
     std::string name,
     uint64_t nbits,
     handle_t handle,
+    uint32_t file_id,
     std::shared_ptr<Node> owner_node,
     std::shared_ptr<Formatter> formatter,
     decltype(NodeVar::attrs) attrs) :
@@ -14,7 +15,8 @@ NodeVar::NodeVar(
     owner_node(owner_node),
     formatter(std::move(formatter)),
     attrs(attrs),
-    handle(handle)
+    handle(handle),
+    file_id(file_id)
 {
 }
 
@@ -24,5 +26,5 @@ std::string NodeVar::pretty_name() const
 }
 
 NodeID NodeVar::stable_id() const {
-	return handle;
+	return (NodeID(file_id) << 32) | handle;
 }
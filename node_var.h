@@ -8,7 +8,8 @@
 
 struct Node;
 
-using NodeID = handle_t;
+// the file id in the upper and the handle in the lower 32 bits, as handles are only unique per file
+using NodeID = uint64_t;
 
 // node vars should know which Node they belong to, because we want to support multiple fstfiles per
 // trace (ie up to one per node to avoid inter thread sync)
@@ -24,6 +25,7 @@ struct NodeVar
 	    std::string name,
 	    uint64_t nbits,
 	    handle_t handle,
+	    uint32_t file_id,
 	    std::shared_ptr<Node> owner_node,
 	    std::shared_ptr<Formatter> formatter,
 		decltype(NodeVar::attrs) attrs);
@@ -42,6 +44,7 @@ struct NodeVar
 private:
 	using handle_t = ::handle_t;
 	handle_t handle;
+	uint32_t file_id;
 	friend struct FstFile;
 };
 
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace impl {
+inline size_t default_parallelism()
+{
+	auto n = std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+// Runs `map` on up to `window` elements concurrently, but hands the results to `consume` strictly
+// in input order on the calling thread. A fixed set of workers fills a ring of `window` slots, a
+// worker only takes the next element once its slot has been consumed.
+template <class It, class M, class C>
+void ordered_parallel_for_each(It begin, It end, size_t window, M&& map, C&& consume)
+{
+	using R = std::invoke_result_t<M&, decltype(*begin)>;
+	struct Slot
+	{
+		std::optional<R> result;
+		std::exception_ptr error;
+	};
+	window = std::max<size_t>(window, 1);
+	std::vector<Slot> ring(window);
+	std::mutex mutex;
+	std::condition_variable changed;
+	auto it = begin;
+	size_t issued = 0;
+	size_t consumed = 0;
+	bool stopped = false;
+
+	auto worker = [&] {
+		auto lock = std::unique_lock(mutex);
+		while (true) {
+			changed.wait(lock, [&] { return stopped or it == end or issued < consumed + window; });
+			if (stopped or it == end) {
+				return;
+			}
+			auto i = issued++;
+			auto element = it++;
+			lock.unlock();
+			Slot slot;
+			try {
+				slot.result.emplace(map(*element));
+			} catch (...) {
+				slot.error = std::current_exception();
+			}
+			lock.lock();
+			ring[i % window] = std::move(slot);
+			changed.notify_all();
+		}
+	};
+	std::vector<std::future<void>> workers;
+	auto stop = [&] {
+		{
+			auto guard = std::lock_guard(mutex);
+			stopped = true;
+		}
+		changed.notify_all();
+		for (auto& w : workers) {
+			w.get();
+		}
+	};
+	auto n = static_cast<size_t>(std::ranges::distance(begin, end));
+	for (size_t t = 0; t < std::min(window, n); t++) {
+		workers.push_back(std::async(std::launch::async, worker));
+	}
+
+	try {
+		for (size_t i = 0; i < n; i++) {
+			auto lock = std::unique_lock(mutex);
+			auto& slot = ring[i % window];
+			changed.wait(lock, [&] { return slot.result or slot.error; });
+			auto ready = std::exchange(slot, Slot{});
+			consumed++;
+			lock.unlock();
+			changed.notify_all();
+			if (ready.error) {
+				std::rethrow_exception(ready.error);
+			}
+			consume(std::move(*ready.result));
+		}
+	} catch (...) {
+		stop();
+		throw;
+	}
+	stop();
+}
+
+// runs f(i) for every i in [0, n) on up to `threads` threads, including the calling one
+template <class F>
+void parallel_for(size_t n, size_t threads, F&& f)
+{
+	std::atomic<size_t> next{0};
+	auto worker = [&] {
+		for (size_t i; (i = next++) < n;) {
+			f(i);
+		}
+	};
+	std::vector<std::future<void>> workers;
+	for (size_t t = 1; t < std::min(threads, n); t++) {
+		workers.push_back(std::async(std::launch::async, worker));
+	}
+	worker();
+	for (auto& w : workers) {
+		w.get();
+	}
+}
+}
@@ -0,0 +1,175 @@
+#include "preindexer.h"
+#include "fst_file.h"
+#include "imgui.h"
+#include "node.h"
+
+#include <algorithm>
+#include <format>
+#include <print>
+
+namespace {
+bool in_scopes(const std::string& path, std::span<const std::string> scopes)
+{
+	return scopes.empty() or std::ranges::any_of(scopes, [&](const std::string& scope) {
+		       return path.starts_with(scope) and
+		              (path.size() == scope.size() or path[scope.size()] == '.');
+	       });
+}
+
+void collect_vars(
+    const NodeData& data,
+    const std::string& path,
+    std::span<const std::string> scopes,
+    std::vector<NodeVar>& vars)
+{
+	if (in_scopes(path, scopes)) {
+		for (const auto& [_, var] : data.variables) {
+			vars.push_back(var);
+		}
+	}
+	for (const auto& [name, subscope] : data.subscopes) {
+		collect_vars(subscope, path.empty() ? name : path + "." + name, scopes, vars);
+	}
+}
+}
+
+Preindexer::Preindexer(std::vector<NodeVar> all_vars, size_t budget_bytes, size_t threads) :
+    budget(budget_bytes)
+{
+	std::unordered_set<NodeID> seen;
+	std::unordered_set<const FstFile*> files;
+	std::vector<std::pair<uint64_t, NodeVar>> by_cost;
+	for (auto& var : all_vars) {
+		if (seen.insert(var.stable_id()).second) {
+			const auto& file = *var.owner_node->ctx;
+			files.insert(&file);
+			by_cost.emplace_back(file.read_cost(var), std::move(var));
+		}
+	}
+	// cheap ones first, most vars are ready early and the big ones are rarely looked at
+	std::stable_sort(by_cost.begin(), by_cost.end(), [](const auto& a, const auto& b) {
+		return a.first < b.first;
+	});
+	vars.reserve(by_cost.size());
+	for (auto& [_, var] : by_cost) {
+		vars.push_back(std::move(var));
+	}
+
+	std::println(
+	    "preindexing {} vars on {} threads, holding up to {}MiB", vars.size(), threads,
+	    budget >> 20);
+	for (size_t t = 0; t < std::min(threads, vars.size()); t++) {
+		// every worker gets its own copies, the cursor and value buffer are not thread safe
+		FileCopies copies;
+		for (auto file : files) {
+			copies.emplace(file, std::make_shared<FstFile>(*file));
+		}
+		workers.push_back(std::async(std::launch::async, &Preindexer::work, this, std::move(copies)));
+	}
+}
+
+Preindexer::~Preindexer()
+{
+	stop();
+}
+
+std::unordered_map<NodeID, WaveDatabase*> Preindexer::stop()
+{
+	{
+		auto guard = std::lock_guard(mutex);
+		stopped = true;
+	}
+	taken_changed.notify_all();
+	for (auto& worker : workers) {
+		worker.get();
+	}
+	workers.clear();
+
+	std::unordered_map<NodeID, WaveDatabase*> dbs;
+	for (auto& [id, db] : built) {
+		dbs.emplace(id, &db);
+	}
+	return dbs;
+}
+
+void Preindexer::work(FileCopies files)
+{
+	for (size_t i; not stopped and (i = next++) < vars.size();) {
+		const auto& var = vars[i];
+		bool wanted;
+		{
+			auto lock = std::unique_lock(mutex);
+			// over budget the rest is built on demand, unless takes free memory
+			taken_changed.wait(lock, [&] {
+				return stopped or held < budget or taken.contains(var.stable_id());
+			});
+			if (stopped) {
+				return;
+			}
+			wanted = not taken.contains(var.stable_id());
+		}
+		if (wanted) {
+			const auto& file = files.at(var.owner_node->ctx.get());
+			auto db = file->read_wave_db(var);
+			auto guard = std::lock_guard(mutex);
+			if (not taken.contains(var.stable_id())) {
+				held += db.memory_usage();
+				built.emplace(var.stable_id(), std::move(db));
+			}
+		}
+		finished++;
+	}
+}
+
+std::vector<NodeVar> Preindexer::vars_under(
+    const std::vector<std::shared_ptr<Node>>& nodes, std::span<const std::string> scopes)
+{
+	std::vector<NodeVar> vars;
+	for (const auto& node : nodes) {
+		collect_vars(node->data, "", scopes, vars);
+	}
+	return vars;
+}
+
+std::optional<WaveDatabase> Preindexer::take(NodeID id)
+{
+	std::optional<WaveDatabase> result;
+	{
+		auto guard = std::lock_guard(mutex);
+		taken.insert(id);
+		auto entry = built.extract(id);
+		if (not entry.empty()) {
+			held -= entry.mapped().memory_usage();
+			result = std::move(entry.mapped());
+		}
+	}
+	taken_changed.notify_all();
+	return result;
+}
+
+size_t Preindexer::done() const
+{
+	return finished;
+}
+
+size_t Preindexer::total() const
+{
+	return vars.size();
+}
+
+size_t Preindexer::held_bytes() const
+{
+	return held;
+}
+
+void Preindexer::render_progress() const
+{
+	auto n = done();
+	if (n >= total()) {
+		return;
+	}
+	auto label = held_bytes() >= budget
+	                 ? std::format("indexing {}/{}, paused at {}MiB", n, total(), budget >> 20)
+	                 : std::format("indexing {}/{}", n, total());
+	ImGui::ProgressBar(float(n) / total(), ImVec2(-FLT_MIN, 0), label.c_str());
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "node_var.h"
+#include "parallel.h"
+#include "wave_data_base.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct FstFile;
+struct Node;
+
+// builds the wave databases of many vars on a pool of workers while the UI is already up, cheapest
+// first, so most vars can be added to the waveform viewer without reading the file. The databases
+// are held until they are taken, once they add up to the budget the workers wait for takes.
+struct Preindexer
+{
+	static constexpr size_t DEFAULT_BUDGET_BYTES = 512 << 20;
+
+	// the vars may be spread over several files, each is read through the file of its node
+	Preindexer(
+	    std::vector<NodeVar> vars,
+	    size_t budget_bytes = DEFAULT_BUDGET_BYTES,
+	    size_t threads = impl::default_parallelism());
+
+	// lets the databases being built finish and drops the rest
+	~Preindexer();
+
+	// the vars of all nodes inside any of the scopes, all vars if there are none. A scope is a dot
+	// separated path inside a node, e.g. "router.input".
+	static std::vector<NodeVar> vars_under(
+	    const std::vector<std::shared_ptr<Node>>& nodes, std::span<const std::string> scopes);
+
+	// hands out the database of id if it is built. Never waits: if it is not, the workers skip the
+	// var from now on, as the caller builds it itself.
+	std::optional<WaveDatabase> take(NodeID id);
+
+	size_t done() const;
+
+	size_t total() const;
+
+	// the memory of the databases built and not taken yet
+	size_t held_bytes() const;
+
+	// stops the workers and returns the databases built and not taken by NodeVar::stable_id, so
+	// they can be saved in the index. Valid as long as nothing is taken.
+	std::unordered_map<NodeID, WaveDatabase*> stop();
+
+	// a progress bar in the current window, until every var is done
+	void render_progress() const;
+
+private:
+	// ordered by estimated cost
+	std::vector<NodeVar> vars;
+	std::atomic<size_t> next{0};
+	std::atomic<size_t> finished{0};
+	std::atomic<bool> stopped{false};
+
+	size_t budget;
+	std::atomic<size_t> held{0};
+
+	std::mutex mutex;
+	// notified on takes, which free memory or make a var unwanted
+	std::condition_variable taken_changed;
+	std::unordered_map<NodeID, WaveDatabase> built;
+	std::unordered_set<NodeID> taken;
+
+	std::vector<std::future<void>> workers;
+
+	// copies of the files by the original, one set per worker
+	using FileCopies = std::unordered_map<const FstFile*, std::shared_ptr<FstFile>>;
+
+	void work(FileCopies files);
+};
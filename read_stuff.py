@@ -70,8 +70,7 @@ def process(n):
             open = imgui.tree_node(name)
             if imgui.begin_popup_context_item():
                 if imgui.selectable("add to viewer", False)[0]:
-                    for v in subscope.variables.values():
-                        n.add_var_to_viewer(v)
+                    n.add_vars_to_viewer(list(subscope.variables.values()))
                 if imgui.selectable("show histogram", False)[0]:
                     for v in subscope.variables.values():
                         n.add_hist(v, clk_var, [], [], True)
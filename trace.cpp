@@ -0,0 +1,124 @@
+#include "trace.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <print>
+#include <ranges>
+#include <stdexcept>
+
+namespace {
+// the threads each of n files is parsed on when they are opened in parallel, so there are never
+// more than default_parallelism() in total
+size_t threads_per_file(size_t n)
+{
+	return std::max<size_t>(impl::default_parallelism() / std::max<size_t>(n, 1), 1);
+}
+
+// the files of every FstFile, more than one for time split traces
+std::vector<std::vector<std::string>> expand_paths(std::span<const std::string> paths)
+{
+	std::vector<std::vector<std::string>> files;
+	for (const auto& path : paths) {
+		if (path.contains(',')) {
+			auto& segments = files.emplace_back();
+			for (auto segment : std::views::split(path, ',')) {
+				segments.emplace_back(segment.begin(), segment.end());
+			}
+			continue;
+		}
+		if (not std::filesystem::is_directory(path)) {
+			files.push_back({path});
+			continue;
+		}
+		std::vector<std::string> in_dir;
+		for (const auto& entry : std::filesystem::directory_iterator(path)) {
+			if (entry.is_regular_file() and entry.path().extension() == ".fst") {
+				in_dir.push_back(entry.path().string());
+			}
+		}
+		// the node order should not depend on the file system
+		std::ranges::sort(in_dir);
+		for (auto& file : in_dir) {
+			files.push_back({std::move(file)});
+		}
+	}
+	return files;
+}
+}
+
+Trace::Trace(std::span<const std::string> paths, size_t cache_bytes)
+{
+	auto to_open = expand_paths(paths);
+	if (to_open.empty()) {
+		throw std::runtime_error("no fst files to open");
+	}
+
+	files.resize(to_open.size());
+	nodes_read.assign(to_open.size(), false);
+	auto file_cache_bytes = cache_bytes / to_open.size();
+	auto file_threads = threads_per_file(to_open.size());
+	impl::parallel_for(to_open.size(), impl::default_parallelism(), [&](size_t i) {
+		files[i] = std::make_shared<FstFile>(to_open[i], file_cache_bytes, file_threads);
+	});
+	std::println("opened {} fst files", files.size());
+}
+
+std::vector<std::shared_ptr<Node>> Trace::read_nodes(WaveformViewer * waveform_viewer, Histograms * histograms, AsyncRunner * async_runner)
+{
+	std::vector<size_t> to_read;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (not nodes_read[i] and files[i]->has_hierarchy()) {
+			nodes_read[i] = true;
+			to_read.push_back(i);
+		}
+	}
+
+	std::vector<std::vector<std::shared_ptr<Node>>> per_file(to_read.size());
+	auto file_threads = threads_per_file(to_read.size());
+	impl::parallel_for(to_read.size(), impl::default_parallelism(), [&](size_t i) {
+		per_file[i] =
+		    files[to_read[i]]->read_nodes(waveform_viewer, histograms, async_runner, file_threads);
+	});
+
+	std::vector<std::shared_ptr<Node>> nodes;
+	for (auto& file_nodes : per_file) {
+		nodes.insert(nodes.end(), file_nodes.begin(), file_nodes.end());
+	}
+	return nodes;
+}
+
+uint64_t Trace::min_time() const
+{
+	uint64_t time = UINT64_MAX;
+	for (const auto& file : files) {
+		time = std::min(time, file->min_time());
+	}
+	return time;
+}
+
+uint64_t Trace::max_time() const
+{
+	uint64_t time = 0;
+	for (const auto& file : files) {
+		time = std::max(time, file->max_time());
+	}
+	return time;
+}
+
+void Trace::save_index(const std::unordered_map<NodeID, WaveDatabase*>& dbs) const
+{
+	std::vector<std::map<handle_t, WaveDatabase*>> per_file(files.size());
+	for (const auto& [id, db] : dbs) {
+		auto file = std::ranges::find_if(files, [&](const auto& file) {
+			return file->file_id() == id >> 32;
+		});
+		if (file != files.end()) {
+			per_file[file - files.begin()].emplace(handle_t(id & 0xffff'ffff), db);
+		}
+	}
+	impl::parallel_for(files.size(), impl::default_parallelism(), [&](size_t i) {
+		files[i]->save_index(per_file[i]);
+	});
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "fst_file.h"
+
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct WaveformViewer;
+struct Histograms;
+struct AsyncRunner;
+struct Node;
+
+// all fst files of one simulation, for example one per node of a mesh that was dumped in parallel.
+// Every file backs its own nodes, they share one time axis.
+struct Trace
+{
+	std::vector<std::shared_ptr<FstFile>> files;
+	// whether the nodes of each file were handed out by read_nodes
+	std::vector<bool> nodes_read;
+
+	// directories stand for the .fst files in them, a comma separated list of files for one time
+	// split trace. The files are opened in parallel and split the signal cache budget and the
+	// threads between them.
+	Trace(std::span<const std::string> paths, size_t cache_bytes = FstFile::DEFAULT_CACHE_BYTES);
+
+	// the nodes of the files not read so far, the hierarchies are read in parallel. A file that is
+	// still being written has no hierarchy, as it is only written on close, and so has no nodes.
+	std::vector<std::shared_ptr<Node>> read_nodes(WaveformViewer * waveform_viewer, Histograms * histograms, AsyncRunner * async_runner);
+
+	uint64_t min_time() const;
+
+	uint64_t max_time() const;
+
+	// dbs are the wave databases in memory by NodeVar::stable_id, each is saved in the index of its
+	// file
+	void save_index(const std::unordered_map<NodeID, WaveDatabase*>& dbs) const;
+};
@@ -25,6 +25,12 @@ UncompressedWaveDatabase<BINARY_SEARCH>::UncompressedWaveDatabase(
 {
 }
 
+template <bool BINARY_SEARCH>
+void UncompressedWaveDatabase<BINARY_SEARCH>::append(std::span<const WaveValue> new_values)
+{
+	std::ranges::copy(new_values | std::views::transform(&WaveValue::pack), std::back_inserter(values));
+}
+
 template <bool BINARY_SEARCH>
 WaveValue UncompressedWaveDatabase<BINARY_SEARCH>::get(size_t idx)
 {
@@ -240,6 +246,41 @@ BenchmarkingDatabase<DBS...>::BenchmarkingDatabase(std::span<const WaveValue> va
 {
 }
 
+template <class... DBS>
+BenchmarkingDatabase<DBS...> BenchmarkingDatabase<DBS...>::with_kind(std::span<const WaveValue> values, size_t kind)
+{
+	std::optional<std::variant<DBS...>> db;
+	([&]<std::size_t... Is>(std::index_sequence<Is...>) {
+		void(((kind == Is && (void(db.emplace(std::in_place_index<Is>, values)), 1)) || ...));
+	}(std::make_index_sequence<sizeof...(DBS)>{}));
+	assert(db);
+	return BenchmarkingDatabase(std::move(*db));
+}
+
+template <class... DBS>
+void BenchmarkingDatabase<DBS...>::append(std::span<const WaveValue> values)
+{
+	if (values.empty()) {
+		return;
+	}
+	std::visit(
+	    [&]<class DB>(DB& db) {
+		    if constexpr (requires { db.append(values); }) {
+			    db.append(values);
+		    } else {
+			    // can't be extended in place, so decode and encode everything again
+			    std::vector<WaveValue> all;
+			    all.reserve(db.size() + values.size());
+			    for (size_t i = 0; i < db.size(); i++) {
+				    all.push_back(db.get(i));
+			    }
+			    all.insert(all.end(), values.begin(), values.end());
+			    db = DB(all);
+		    }
+	    },
+	    the_db);
+}
+
 template <class... DBS>
 WaveValue BenchmarkingDatabase<DBS...>::get(size_t idx)
 {
@@ -379,15 +420,270 @@ std::pair<uint32_t, uint32_t> work(DB& db, bool jumpy)
 	return {sum, ops};
 }
 
+namespace {
+// bit i of the stream is bit i % 64 of word i / 64, len <= 64
+uint64_t read_bits(const uint64_t* words, uint64_t pos, unsigned len)
+{
+	if (len == 0) {
+		return 0;
+	}
+	auto word = pos / 64;
+	auto shift = pos % 64;
+	uint64_t v = words[word] >> shift;
+	if (shift + len > 64) {
+		v |= words[word + 1] << (64 - shift);
+	}
+	return len == 64 ? v : v & ((uint64_t(1) << len) - 1);
+}
+
+// only the lower len bits of value are written
+void write_bits(std::vector<uint64_t>& words, uint64_t& pos, uint64_t value, unsigned len)
+{
+	if (len == 0) {
+		return;
+	}
+	words.resize(std::max(words.size(), (pos + len + 63) / 64), 0);
+	if (len < 64) {
+		value &= (uint64_t(1) << len) - 1;
+	}
+	auto word = pos / 64;
+	auto shift = pos % 64;
+	words[word] |= value << shift;
+	if (shift + len > 64) {
+		words[word + 1] |= value >> (64 - shift);
+	}
+	pos += len;
+}
+
+// the lower bits elias fano keeps verbatim for n values below universe
+unsigned elias_fano_width(uint64_t universe, uint64_t n)
+{
+	return universe > n ? std::bit_width(universe / n) - 1 : 0;
+}
+}
+
+PartitionedEliasFanoWaveDatabase::PartitionedEliasFanoWaveDatabase(std::span<const WaveValue> values) :
+    count(values.size())
+{
+	uint64_t pos = 0;
+	for (size_t begin = 0; begin < values.size(); begin += PARTITION_SIZE) {
+		auto part = values.subspan(begin, std::min(PARTITION_SIZE, values.size() - begin));
+		uint32_t first = part.front().pack();
+		uint32_t last = part.back().pack();
+		uint64_t n = part.size();
+		uint64_t universe = uint64_t(last - first) + 1;
+
+		unsigned plain_width = std::bit_width(last - first);
+		unsigned ef_width = elias_fano_width(universe, n);
+		uint64_t bitmap_bits = universe;
+		uint64_t plain_bits = n * plain_width;
+		uint64_t ef_bits = n * ef_width + n + ((last - first) >> ef_width) + 1;
+
+		Partition partition{pos, first, Encoding::EliasFano, static_cast<uint8_t>(ef_width)};
+		if (bitmap_bits <= std::min(plain_bits, ef_bits)) {
+			partition.encoding = Encoding::Bitmap;
+			partition.width = 0;
+		} else if (plain_bits < ef_bits) {
+			partition.encoding = Encoding::Plain;
+			partition.width = plain_width;
+		}
+
+		switch (partition.encoding) {
+			case Encoding::EliasFano: {
+				for (const auto& v : part) {
+					write_bits(data, pos, v.pack() - first, ef_width);
+				}
+				// unary high parts: value k sets bit k + (offset >> width)
+				auto high_start = pos;
+				for (size_t k = 0; k < n; k++) {
+					auto bit = high_start + k + ((part[k].pack() - first) >> ef_width);
+					auto at = bit;
+					write_bits(data, at, 1, 1);
+				}
+				pos = high_start + ef_bits - n * ef_width;
+				break;
+			}
+			case Encoding::Bitmap: {
+				for (const auto& v : part) {
+					auto at = pos + (v.pack() - first);
+					write_bits(data, at, 1, 1);
+				}
+				pos += bitmap_bits;
+				break;
+			}
+			case Encoding::Plain: {
+				for (const auto& v : part) {
+					write_bits(data, pos, v.pack() - first, plain_width);
+				}
+				break;
+			}
+		}
+		partitions.push_back(partition);
+		partition_last.push_back(last);
+	}
+	// one word of padding, so reads of a full word never run past the end
+	data.resize((pos + 63) / 64 + 1, 0);
+	data.shrink_to_fit();
+	if (count > 0) {
+		load(0);
+	}
+}
+
+size_t PartitionedEliasFanoWaveDatabase::partition_size(size_t partition) const
+{
+	return std::min(PARTITION_SIZE, count - partition * PARTITION_SIZE);
+}
+
+void PartitionedEliasFanoWaveDatabase::load(size_t partition)
+{
+	idx_in_partition = 0;
+	if (partition == partition_idx) {
+		return;
+	}
+	partition_idx = partition;
+	if (not decoded) {
+		decoded = std::make_unique_for_overwrite<uint32_t[]>(PARTITION_SIZE);
+	}
+
+	const auto& p = partitions[partition];
+	auto n = partition_size(partition);
+	switch (p.encoding) {
+		case Encoding::EliasFano: {
+			auto high_pos = p.bit_offset + n * p.width;
+			for (size_t k = 0, bit = 0; k < n; bit += 64) {
+				for (auto word = read_bits(data.data(), high_pos + bit, 64); word != 0 and k < n;
+				     word &= word - 1, k++) {
+					uint64_t high = bit + std::countr_zero(word) - k;
+					auto low = read_bits(data.data(), p.bit_offset + k * p.width, p.width);
+					decoded[k] = p.first + ((high << p.width) | low);
+				}
+			}
+			break;
+		}
+		case Encoding::Bitmap: {
+			uint64_t universe = uint64_t(partition_last[partition] - p.first) + 1;
+			size_t k = 0;
+			for (uint64_t bit = 0; bit < universe; bit += 64) {
+				auto len = static_cast<unsigned>(std::min<uint64_t>(64, universe - bit));
+				for (auto word = read_bits(data.data(), p.bit_offset + bit, len); word != 0;
+				     word &= word - 1) {
+					decoded[k++] = p.first + bit + std::countr_zero(word);
+				}
+			}
+			break;
+		}
+		case Encoding::Plain: {
+			for (size_t k = 0; k < n; k++) {
+				decoded[k] = p.first + read_bits(data.data(), p.bit_offset + k * p.width, p.width);
+			}
+			break;
+		}
+	}
+}
+
+WaveValue PartitionedEliasFanoWaveDatabase::seek_in(size_t partition, size_t from, uint32_t encoded)
+{
+	load(partition);
+	auto begin = decoded.get();
+	auto end = begin + partition_size(partition);
+	idx_in_partition = std::lower_bound(begin + from, end, encoded) - begin;
+	return WaveValue::unpack(decoded[idx_in_partition]);
+}
+
+WaveValue PartitionedEliasFanoWaveDatabase::get(size_t idx)
+{
+	load(idx / PARTITION_SIZE);
+	idx_in_partition = idx % PARTITION_SIZE;
+	return WaveValue::unpack(decoded[idx_in_partition]);
+}
+
+uint32_t PartitionedEliasFanoWaveDatabase::memory_usage()
+{
+	// the cursor buffer is counted even before it is allocated, it is as soon as the db is read
+	return data.size() * sizeof(data[0]) + partitions.size() * sizeof(Partition) +
+	       partition_last.size() * sizeof(uint32_t) + PARTITION_SIZE * sizeof(uint32_t);
+}
+
+std::optional<WaveValue> PartitionedEliasFanoWaveDatabase::skip_to(WaveValue to_find)
+{
+	uint32_t encoded = to_find.timestamp << WaveValue::ValueTypeBits;
+	if (count == 0) {
+		return std::nullopt;
+	}
+	// like the elias fano reader, stop at the last value
+	if (encoded > partition_last.back()) {
+		get(count - 1);
+		return std::nullopt;
+	}
+	if (partition_last[partition_idx] >= encoded) {
+		return seek_in(partition_idx, idx_in_partition, encoded);
+	}
+	auto next = std::lower_bound(
+	    partition_last.begin() + partition_idx + 1, partition_last.end(), encoded);
+	return seek_in(next - partition_last.begin(), 0, encoded);
+}
+
+std::optional<WaveValue> PartitionedEliasFanoWaveDatabase::jump_to(WaveValue to_find)
+{
+	uint32_t encoded = to_find.timestamp << WaveValue::ValueTypeBits;
+	if (count == 0) {
+		return std::nullopt;
+	}
+	if (encoded > partition_last.back()) {
+		get(count - 1);
+		return std::nullopt;
+	}
+	auto partition = std::lower_bound(partition_last.begin(), partition_last.end(), encoded);
+	return seek_in(partition - partition_last.begin(), 0, encoded);
+}
+
+std::optional<WaveValue> PartitionedEliasFanoWaveDatabase::previous_value()
+{
+	if (idx_in_partition > 0) {
+		return {WaveValue::unpack(decoded[idx_in_partition - 1])};
+	}
+	if (partition_idx > 0 and partition_idx < partitions.size()) {
+		return {WaveValue::unpack(partition_last[partition_idx - 1])};
+	}
+	return std::nullopt;
+}
+
+std::optional<WaveValue> PartitionedEliasFanoWaveDatabase::value()
+{
+	if (partition_idx >= partitions.size()) {
+		return std::nullopt;
+	}
+	return {WaveValue::unpack(decoded[idx_in_partition])};
+}
+
+void PartitionedEliasFanoWaveDatabase::rewind()
+{
+	if (count > 0) {
+		load(0);
+	}
+}
+
+WaveValue PartitionedEliasFanoWaveDatabase::last()
+{
+	return WaveValue::unpack(partition_last.back());
+}
+
+uint32_t PartitionedEliasFanoWaveDatabase::size() const
+{
+	return count;
+}
+
 template struct BenchmarkingDatabase<
     UncompressedWaveDatabase<true>,
     // UncompressedWaveDatabase<false>,
-    EliasFanoWaveDatabase>;
+    EliasFanoWaveDatabase,
+    PartitionedEliasFanoWaveDatabase>;
 
 template std::pair<uint32_t, uint32_t> work<>(WaveDatabase& db, bool);
 template std::pair<uint32_t, uint32_t> work<>(UncompressedWaveDatabase<false>& db, bool);
 template std::pair<uint32_t, uint32_t> work<>(UncompressedWaveDatabase<true>& db, bool);
 template std::pair<uint32_t, uint32_t> work<>(EliasFanoWaveDatabase& db, bool);
+template std::pair<uint32_t, uint32_t> work<>(PartitionedEliasFanoWaveDatabase& db, bool);
 
 template struct impl::UncompressedWaveDatabase<true>;
 template struct impl::UncompressedWaveDatabase<false>;
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <print>
+#include <array>
 #include <cinttypes>
 #include <format>
+#include <memory>
 #include <vector>
 #include <folly/compression/elias_fano/EliasFanoCoding.h>
 
@@ -89,6 +91,9 @@ struct UncompressedWaveDatabase
 
 	UncompressedWaveDatabase(std::span<const WaveValue> values);
 
+	// values have to be later than the current last one
+	void append(std::span<const WaveValue> values);
+
 	WaveValue get(size_t idx);
 
 	uint32_t memory_usage();
@@ -159,6 +164,74 @@ private:
 	// static EncoderT::CompressedList init_data(std::span<const WaveValue> values);
 };
 
+// splits the values into partitions of PARTITION_SIZE and encodes each relative to its first value
+// with whatever is smallest for it: elias fano, a bitmap (dense bursts) or plain fixed width
+// offsets. Long idle gaps then cost next to nothing, unlike with a single elias fano over everything.
+// The partition under the cursor is kept decoded, in a buffer allocated on first use so the database
+// itself stays small inside the WaveDatabase variant.
+struct PartitionedEliasFanoWaveDatabase
+{
+	static constexpr size_t PARTITION_SIZE = 128;
+
+	enum class Encoding : uint8_t
+	{
+		EliasFano,
+		Bitmap,
+		Plain,
+	};
+
+	struct Partition
+	{
+		// of the encoded partition in data
+		uint64_t bit_offset;
+		// packed value the partition is encoded relative to
+		uint32_t first;
+		Encoding encoding;
+		// lower bits for elias fano, bits per value for plain
+		uint8_t width;
+	};
+
+	PartitionedEliasFanoWaveDatabase(std::span<const WaveValue> values);
+
+	WaveValue get(size_t idx);
+
+	uint32_t memory_usage();
+
+	// finds next value geq from current position
+	std::optional<WaveValue> skip_to(WaveValue to_find);
+
+	std::optional<WaveValue> jump_to(WaveValue to_find);
+
+	std::optional<WaveValue> previous_value();
+
+	std::optional<WaveValue> value();
+
+	void rewind();
+
+	WaveValue last();
+
+	uint32_t size() const;
+
+private:
+	std::vector<Partition> partitions;
+	// last packed value of every partition, searched to find the partition of a value
+	std::vector<uint32_t> partition_last;
+	std::vector<uint64_t> data;
+	uint32_t count;
+
+	// cursor
+	size_t partition_idx = SIZE_MAX;
+	size_t idx_in_partition = 0;
+	std::unique_ptr<uint32_t[]> decoded;
+
+	size_t partition_size(size_t partition) const;
+
+	void load(size_t partition);
+
+	// moves the cursor to the first value geq encoded in partition, which has to contain one
+	WaveValue seek_in(size_t partition, size_t from, uint32_t encoded);
+};
+
 // polymorphism was slower :(
 template <class... DBS>
 struct BenchmarkingDatabase
@@ -167,11 +240,23 @@ struct BenchmarkingDatabase
 
 	BenchmarkingDatabase(std::span<const WaveValue> values, bool jumpy = false);
 
+	// builds the database with index `kind` in DBS directly, without benchmarking
+	static BenchmarkingDatabase with_kind(std::span<const WaveValue> values, size_t kind);
+
+	// the index of the chosen database in DBS
+	size_t kind() const
+	{
+		return the_db.index();
+	}
+
 	BenchmarkingDatabase(const BenchmarkingDatabase &) = delete;
 	BenchmarkingDatabase & operator=(const BenchmarkingDatabase &) = delete;
 	BenchmarkingDatabase(BenchmarkingDatabase &&) = default;
 	BenchmarkingDatabase & operator=(BenchmarkingDatabase &&) = default;
 
+	// for files that are still being written, values have to be later than the current last one
+	void append(std::span<const WaveValue> values);
+
 	WaveValue get(size_t idx);
 
 	uint32_t memory_usage();
@@ -192,6 +277,8 @@ struct BenchmarkingDatabase
 	uint32_t size();
 
 private:
+	BenchmarkingDatabase(std::variant<DBS...> db) : the_db(std::move(db)) {}
+
 	static std::variant<DBS...> find_best_db(std::span<const WaveValue> values, bool jumpy);
 };
 
@@ -200,11 +287,9 @@ std::pair<uint32_t, uint32_t> work(DB& db, bool);
 }
 
 
-// TODO(robin): partitioned elias fano should probably be even better
-// (good for locally clustered data <-> bursty activity)
-// Such as the open-source http://github.com/facebook/ folly, http://github.com/simongog/sdsl,
-// http:// github.com/ot/succinct, and http://sux.di.unimi.it.
+// new databases go at the end, the index of the chosen one is stored in the sidecar index
 using WaveDatabase = impl::BenchmarkingDatabase<
     impl::UncompressedWaveDatabase<true>,
     // impl::UncompressedWaveDatabase<false>,
-    impl::EliasFanoWaveDatabase>;
+    impl::EliasFanoWaveDatabase,
+    impl::PartitionedEliasFanoWaveDatabase>;
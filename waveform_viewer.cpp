@@ -4,10 +4,14 @@
 #include "utils.cpp"
 #include "highlights.h"
 #include "fst_file.h"
+#include "trace.h"
 #include "node.h"
+#include "preindexer.h"
 
 #include <future>
+#include <map>
 #include <print>
+#include <unordered_set>
 
 void DrawCenterText(auto& draw, const char* text, const ImVec2& pos)
 {
@@ -47,8 +51,8 @@ auto clip_text_to_width(std::span<char> text, float pixels)
 
 auto Timeline::render(double zoom, double offset, uint64_t cursor_value, ImRect bb)
 {
-	int64_t min_time = file->min_time();
-	int64_t max_time = file->max_time();
+	int64_t min_time = trace->min_time();
+	int64_t max_time = trace->max_time();
 
 	auto sz = bb.GetSize();
 	auto line_height = ImGui::GetTextLineHeight();
@@ -106,9 +110,9 @@ auto Timeline::render(double zoom, double offset, uint64_t cursor_value, ImRect
 	return std::tuple{first_time, last_time};
 }
 
-Timeline::Timeline(std::shared_ptr<FstFile> file) : file(file) {}
+Timeline::Timeline(std::shared_ptr<Trace> trace) : trace(trace) {}
 
-WaveformViewer::WaveformViewer(std::shared_ptr<FstFile> file, Highlights * highlights) : file(file), highlights(highlights), timeline(file) {}
+WaveformViewer::WaveformViewer(std::shared_ptr<Trace> trace, Highlights * highlights) : trace(trace), highlights(highlights), timeline(trace) {}
 
 // TODO(robin): add group hierarchies
 void WaveformViewer::add(const NodeVar& var, std::span<std::string> group_hier)
@@ -116,18 +120,81 @@ void WaveformViewer::add(const NodeVar& var, std::span<std::string> group_hier)
 	auto guard = std::lock_guard(mutex);
 	vars.push_back(var);
 	if (fac_dbs.find(var.stable_id()) == fac_dbs.end()) {
-		fac_dbs.emplace(std::piecewise_construct, std::forward_as_tuple(var.stable_id()), std::forward_as_tuple(file->read_wave_db(var)));
+		if (auto db = take_preindexed(var)) {
+			fac_dbs.emplace(var.stable_id(), std::move(*db));
+		} else {
+			fac_dbs.emplace(std::piecewise_construct, std::forward_as_tuple(var.stable_id()), std::forward_as_tuple(var.owner_node->ctx->read_wave_db(var)));
+		}
 	}
 }
 
+void WaveformViewer::add(std::span<const NodeVar> vars)
+{
+	auto guard = std::lock_guard(mutex);
+	std::vector<NodeVar> to_read;
+	std::unordered_set<NodeID> seen;
+	for (const auto& var : vars) {
+		this->vars.push_back(var);
+		if (fac_dbs.find(var.stable_id()) == fac_dbs.end() and seen.insert(var.stable_id()).second) {
+			if (auto db = take_preindexed(var)) {
+				fac_dbs.emplace(var.stable_id(), std::move(*db));
+			} else {
+				to_read.push_back(var);
+			}
+		}
+	}
+
+	// one pass over every file the vars are in
+	std::map<FstFile*, std::vector<NodeVar>> by_file;
+	for (auto& var : to_read) {
+		by_file[var.owner_node->ctx.get()].push_back(std::move(var));
+	}
+	for (const auto& [file, file_vars] : by_file) {
+		auto dbs = file->read_wave_dbs(file_vars);
+		for (size_t i = 0; i < file_vars.size(); i++) {
+			fac_dbs.emplace(file_vars[i].stable_id(), std::move(dbs[i]));
+		}
+	}
+}
+
+std::optional<WaveDatabase> WaveformViewer::take_preindexed(const NodeVar& var)
+{
+	if (not preindexer) {
+		return std::nullopt;
+	}
+	return preindexer->take(var.stable_id());
+}
+
+void WaveformViewer::set_preindexer(std::shared_ptr<Preindexer> preindexer)
+{
+	auto guard = std::lock_guard(mutex);
+	this->preindexer = std::move(preindexer);
+}
+
+std::unordered_map<NodeID, WaveDatabase*> WaveformViewer::wave_dbs()
+{
+	auto guard = std::lock_guard(mutex);
+	std::unordered_map<NodeID, WaveDatabase*> dbs;
+	for (auto& [id, db] : fac_dbs) {
+		dbs.emplace(id, &db);
+	}
+	if (preindexer) {
+		dbs.merge(preindexer->stop());
+	}
+	return dbs;
+}
+
 uint64_t WaveformViewer::render()
 {
 	auto guard = std::lock_guard(mutex);
 
-	int64_t min_time = file->min_time();
-	int64_t max_time = file->max_time();
+	int64_t min_time = trace->min_time();
+	int64_t max_time = trace->max_time();
 
 	ImGui::Begin("WaveformViewer");
+	if (preindexer) {
+		preindexer->render_progress();
+	}
 	auto sz = ImGui::GetContentRegionAvail();
 	sz.x = max(sz.x, 1);
 	sz.y = max(sz.y, 1);
@@ -268,7 +335,7 @@ uint64_t WaveformViewer::render()
 				auto& var = vars[i];
 				// std::println("var: {}", var.name);
 
-				char* val = var.value_at_time(cursor_value);
+				char* val = var.owner_node->ctx->get_current_value(var, cursor_value);
 				auto formatted = var.format(val);
 				auto text = std::format("{}: {}", var.pretty_name(), formatted.data());
 				std::span<char> text_span = text;
@@ -528,7 +595,7 @@ void WaveformViewer::draw_waveform(int64_t first_time, int64_t last_time, const
 	}
 
 	for (auto & [time, screen_time, text_space] : text_to_draw) {
-		char* value = file->get_value_at(var, time);
+		char* value = var.owner_node->ctx->get_value_at(var, time);
 		auto text = var.format(value);
 		auto end = clip_text_to_width(text, text_space - 3 * PADDING - 2 * FEATHER_SIZE);
 		draw->AddText(
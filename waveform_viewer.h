@@ -7,21 +7,24 @@
 #include "imgui_internal.h"
 
 #include <cstdint>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <unordered_map>
 #include <span>
 #include <string>
 #include <vector>
 
-struct FstFile;
+struct Trace;
 struct Highlights;
+struct Preindexer;
 
 struct Timeline
 {
-	std::shared_ptr<FstFile> file;
+	std::shared_ptr<Trace> trace;
 	uint32_t first_time, last_time;
 
-	Timeline(std::shared_ptr<FstFile> file);
+	Timeline(std::shared_ptr<Trace> trace);
 
 	auto render(double zoom, double offset, uint64_t cursor_value, ImRect bb);
 };
@@ -39,7 +42,7 @@ const auto MOUSE_WHEEL_DRAG_FACTOR = 10.0f;
 struct WaveformViewer
 {
 private:
-	std::shared_ptr<FstFile> file;
+	std::shared_ptr<Trace> trace;
 	Highlights * highlights;
 	Timeline timeline;
 	double zoom = 1.0;
@@ -56,13 +59,29 @@ private:
 
 	std::unordered_map<NodeID, WaveDatabase> fac_dbs;
 
+	// databases built in the background, taken from here before reading the file
+	std::shared_ptr<Preindexer> preindexer;
+
+	// the database of var from the preindexer, if it was built
+	std::optional<WaveDatabase> take_preindexed(const NodeVar& var);
+
 public:
-	WaveformViewer(std::shared_ptr<FstFile> file, Highlights * highlights);
+	WaveformViewer(std::shared_ptr<Trace> trace, Highlights * highlights);
 
 	uint64_t render();
 
 	void add(const NodeVar& var, std::span<std::string> group_hier = {});
 
+	// adds all vars, reading the ones not yet loaded in a single pass over the file
+	void add(std::span<const NodeVar> vars);
+
+	void set_preindexer(std::shared_ptr<Preindexer> preindexer);
+
+	// the databases of the loaded vars by NodeVar::stable_id, for saving them in the index. Stops
+	// the preindexer and includes the databases it built that were not added. Valid until the next
+	// var is added.
+	std::unordered_map<NodeID, WaveDatabase*> wave_dbs();
+
 private:
 	std::vector<NodeVar> vars;
 